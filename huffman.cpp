@@ -1,5 +1,33 @@
 /* This program creates a huffman tree which provides lossless compression of data or characters.
  */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#endif
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 #include "bits.h"
 #include "treenode.h"
 #include "huffman.h"
@@ -7,9 +35,618 @@
 #include "vector.h"
 #include "priorityqueue.h"
 #include "strlib.h"
+#include "random.h"
 #include "testing/SimpleTest.h"
 using namespace std;
 
+/* Reads eight bytes starting at the given address as one big-endian 64-bit value, so the first
+ * bit of the first byte lands in the highest bit.
+ */
+uint64_t loadBigEndian64(const uint8_t* bytes) {
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    // One unaligned load and a byte swap instead of eight byte loads
+    uint64_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return __builtin_bswap64(value);
+#else
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) {
+        value = (value << 8) | bytes[i];
+    }
+    return value;
+#endif
+}
+
+/* Writes value to the eight bytes starting at the given address in big-endian order, the
+ * counterpart of loadBigEndian64.
+ */
+void storeBigEndian64(uint8_t* bytes, uint64_t value) {
+#if defined(__GNUC__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    value = __builtin_bswap64(value);
+    memcpy(bytes, &value, sizeof(value));
+#else
+    for (int i = 7; i >= 0; i--) {
+        bytes[i] = value & 0xFF;
+        value >>= 8;
+    }
+#endif
+}
+
+/* Returns the count bits (1 to 57) starting at bit position pos of a packed bit stream, first bit
+ * highest. The stream must be readable up to 8 bytes past byte pos / 8.
+ */
+uint64_t peekBitsAt(const uint8_t* bytes, uint64_t pos, int count) {
+    return (loadBigEndian64(bytes + (pos >> 3)) << (pos & 7)) >> (64 - count);
+}
+
+/* A sequence of bits packed 64 to a word, used in place of Queue<Bit>. Bits are appended at the
+ * write cursor and consumed from the read cursor, so it behaves like a queue of bits while costing
+ * one bit of memory per bit instead of a queue element.
+ *
+ * The words are stored in big-endian byte order, so the bytes of the buffer are the bit stream in
+ * order with the first bit in the highest bit of the first byte. A peek is then one unaligned 8-byte
+ * load, and at least one zero word of padding is always kept past the last bit to make that safe.
+ */
+class BitBuffer {
+public:
+    BitBuffer() : words(2, 0), writePos(0), readPos(0) {}
+
+    /* Append the low count bits of bits (1 to 64 of them), most significant first. A whole code
+     * is stored with at most two word-sized ORs.
+     */
+    void writeBits(uint64_t bits, int count) {
+        if (count == 0) return;
+        uint64_t aligned = bits << (64 - count);
+        int offset = writePos & 63;
+        size_t index = writePos >> 6;
+        while (words.size() < index + 3) {
+            words.push_back(0);
+        }
+        uint8_t* base = reinterpret_cast<uint8_t*>(words.data());
+        storeBigEndian64(base + index * 8, loadBigEndian64(base + index * 8) | (aligned >> offset));
+        if (offset + count > 64) {
+            storeBigEndian64(base + (index + 1) * 8, aligned << (64 - offset));
+        }
+        writePos += count;
+    }
+
+    void writeBit(int bit) {
+        writeBits(bit, 1);
+    }
+
+    /* Return the next count bits (1 to 57) without consuming them, first bit highest. Bits past
+     * the end of the buffer read as 0.
+     */
+    uint64_t peek(int count) const {
+        return peekAt(readPos, count);
+    }
+
+    /* Like peek, but at any bit position instead of the read cursor, for readers that keep
+     * several cursors into one buffer.
+     */
+    uint64_t peekAt(uint64_t pos, int count) const {
+        return peekBitsAt(bytes(), pos, count);
+    }
+
+    void skip(int count) {
+        readPos += count;
+    }
+
+    /* Consume and return the next count bits (1 to 64), first bit highest.
+     */
+    uint64_t readBits(int count) {
+        if (count > 57) {
+            uint64_t high = readBits(count - 32);
+            return (high << 32) | readBits(32);
+        }
+        uint64_t bits = peek(count);
+        readPos += count;
+        return bits;
+    }
+
+    int readBit() {
+        return readBits(1);
+    }
+
+    /* Make room for bitCount bits in total, so a known-size encode never reallocates.
+     */
+    void reserve(uint64_t bitCount) {
+        words.reserve(bitCount / 64 + 3);
+    }
+
+    /* Make room for count more bits past the write cursor and return the bytes of the buffer, for
+     * an encoder that stores its bits straight into them. The bytes past the write cursor are
+     * zero, and the 8 bytes after the byte holding the last of the count bits are writable too.
+     * The bits become part of the buffer once commitBits is called.
+     */
+    uint8_t* prepareBits(uint64_t count) {
+        size_t needed = (writePos + count) / 64 + 3;
+        if (words.capacity() < needed) {
+            // Grow by doubling, since an encoder prepares one chunk at a time
+            words.reserve(max(needed, 2 * words.capacity()));
+        }
+        if (words.size() < needed) {
+            words.resize(needed, 0);
+        }
+        return reinterpret_cast<uint8_t*>(words.data());
+    }
+
+    /* Move the write cursor past count bits stored after prepareBits. */
+    void commitBits(uint64_t count) {
+        writePos += count;
+    }
+
+    /* Total number of bits written. */
+    uint64_t size() const {
+        return writePos;
+    }
+
+    /* Number of bits written but not yet read. */
+    uint64_t remaining() const {
+        return writePos - readPos;
+    }
+
+    bool isEmpty() const {
+        return remaining() == 0;
+    }
+
+    uint64_t readPosition() const {
+        return readPos;
+    }
+
+    /* Move the read cursor to bit position pos, for handing back bits consumed through a
+     * BitReader.
+     */
+    void seek(uint64_t pos) {
+        readPos = pos;
+    }
+
+    /* The packed bit stream, followed by at least 8 bytes of zero padding. */
+    const uint8_t* bytes() const {
+        return reinterpret_cast<const uint8_t*>(words.data());
+    }
+
+    /* Replace the contents with the first bitCount bits of the given bytes, with the read cursor
+     * back at the start.
+     */
+    void assign(const uint8_t* source, uint64_t bitCount) {
+        size_t byteCount = (bitCount + 7) / 8;
+        words.assign(bitCount / 64 + 3, 0);
+        uint8_t* base = reinterpret_cast<uint8_t*>(words.data());
+        // An empty source may be a null pointer, which memcpy must not be given even for 0 bytes
+        if (byteCount > 0) {
+            memcpy(base, source, byteCount);
+        }
+        // Clear the unused low bits of the last byte, since later writes OR into them
+        if (bitCount % 8 != 0) {
+            base[byteCount - 1] &= 0xFF << (8 - bitCount % 8);
+        }
+        writePos = bitCount;
+        readPos = 0;
+    }
+
+    /* Bytes of memory held for the bits. */
+    uint64_t memoryUsage() const {
+        return words.capacity() * sizeof(uint64_t);
+    }
+
+private:
+    vector<uint64_t> words;
+    uint64_t writePos;
+    uint64_t readPos;
+};
+
+/* Fewest unread bits a BitReader holds right after a refill: a 64-bit load starting at the byte
+ * that holds the read position loses at most 7 bits to the position's offset within that byte.
+ */
+const int BIT_READER_REFILL_BITS = 57;
+
+/* Reads a packed bit stream through a 64-bit container that holds the next unread bits in its
+ * high end. A refill reloads the container with one unaligned 8-byte load at the byte holding the
+ * read position, so it has no loop and no branch on how many bits were left, and peek and consume
+ * are then a shift each. Callers that know how many bits they need refill once and consume up to
+ * BIT_READER_REFILL_BITS with no test per bit.
+ *
+ * Like BitBuffer::peek, bits past the end read as 0, so the bytes must be readable up to 8 bytes
+ * past the byte holding the last bit, as the bytes of a BitBuffer always are.
+ */
+class BitReader {
+public:
+    BitReader(const uint8_t* bytes, uint64_t bitCount, uint64_t pos = 0) : bytes(bytes), endPos(bitCount), pos(pos) {
+        refill();
+    }
+
+    /* Read the unread bits of buffer, starting at its read cursor. The buffer's cursor does not
+     * move; hand the position back with BitBuffer::seek once done.
+     */
+    explicit BitReader(const BitBuffer& buffer) : BitReader(buffer.bytes(), buffer.size(), buffer.readPosition()) {}
+
+    /* Reload the container so at least BIT_READER_REFILL_BITS unread bits are available. */
+    void refill() {
+        container = loadBigEndian64(bytes + (pos >> 3)) << (pos & 7);
+        available = 64 - (pos & 7);
+    }
+
+    /* Return the next count bits (1 to available()) without consuming them, first bit highest. */
+    uint64_t peek(int count) const {
+        return container >> (64 - count);
+    }
+
+    /* Consume count bits (0 to available()). */
+    void consume(int count) {
+        container <<= count;
+        available -= count;
+        pos += count;
+    }
+
+    /* Consume and return the next count bits (1 to BIT_READER_REFILL_BITS), refilling first if
+     * the container holds too few.
+     */
+    uint64_t readBits(int count) {
+        if (available < count) refill();
+        uint64_t bits = peek(count);
+        consume(count);
+        return bits;
+    }
+
+    int readBit() {
+        return readBits(1);
+    }
+
+    /* Number of bits in the container that can be peeked or consumed without a refill. */
+    int bitsAvailable() const {
+        return available;
+    }
+
+    /* Number of bits of the stream not yet consumed. */
+    uint64_t remaining() const {
+        return endPos - pos;
+    }
+
+    bool isEmpty() const {
+        return pos >= endPos;
+    }
+
+    uint64_t position() const {
+        return pos;
+    }
+
+private:
+    const uint8_t* bytes;
+    uint64_t endPos;
+    uint64_t pos;
+    uint64_t container;
+    int available;
+};
+
+/* Most bits a BitWriter stores at once. With up to 7 bits left over from the previous store, its
+ * container then never holds more than 63.
+ */
+const int BIT_WRITER_STORE_BITS = 56;
+
+/* Bits a BitWriter on a BitBuffer makes room for whenever it runs out. */
+const uint64_t BIT_WRITER_GROWTH = 1 << 12;
+
+/* Writes a packed bit stream through a 64-bit container, the write-side counterpart of BitReader.
+ * Each store ORs a group of bits into the container and writes the container back with one
+ * unaligned 8-byte store, then moves the cursor past the whole bytes it filled, so appending a
+ * code costs a few shifts and no test of whether the container is full.
+ *
+ * A BitWriter either appends to a BitBuffer, making room in it as it goes, or writes into memory
+ * the caller owns, such as a mapped file, from a given bit position. Memory must be zero past the
+ * starting position and writable up to 8 bytes past the byte holding the last bit. Bits appended
+ * to a BitBuffer are not part of it until flush is called, which must happen before the buffer is
+ * read or written any other way.
+ */
+class BitWriter {
+public:
+    explicit BitWriter(BitBuffer& buffer) : buffer(&buffer), limit(buffer.size()) {
+        start(buffer.prepareBits(0), buffer.size());
+    }
+
+    BitWriter(uint8_t* out, uint64_t pos) : buffer(nullptr), limit(UINT64_MAX) {
+        start(out, pos);
+    }
+
+    /* Append the low count bits of bits (0 to 64 of them), most significant first. The bits of
+     * bits above those must be 0.
+     */
+    void writeBits(uint64_t bits, int count) {
+        if (position() + count > limit) makeRoom(count);
+        if (count > BIT_WRITER_STORE_BITS) {
+            storeBits(bits >> 32, count - 32);
+            bits &= 0xFFFFFFFF;
+            count = 32;
+        }
+        storeBits(bits, count);
+    }
+
+    void writeBit(int bit) {
+        writeBits(bit, 1);
+    }
+
+    /* Like writeBits, but for at most BIT_WRITER_STORE_BITS bits and with no check for room, for
+     * an encoder writing into memory it has sized for everything it writes.
+     */
+    void storeBits(uint64_t group, uint64_t count) {
+        used += count;
+        // Split in two so neither shift is by 64, even for an empty group at bit 0
+        container |= (group << 1) << (63 - used);
+        storeBigEndian64(cursor, container);
+        cursor += used >> 3;
+        container <<= used & ~7;
+        used &= 7;
+    }
+
+    /* The bit position after the last bit written. */
+    uint64_t position() const {
+        return (cursor - out) * (uint64_t) 8 + used;
+    }
+
+    /* Make the bits written so far part of the buffer. Writing into memory needs no flush. */
+    void flush() {
+        if (buffer != nullptr) {
+            buffer->commitBits(position() - buffer->size());
+        }
+    }
+
+private:
+    BitBuffer* buffer;
+    uint64_t limit;  // bit position up to which there is room to write
+    uint8_t* out;
+    uint8_t* cursor;
+    uint64_t used;
+    uint64_t container;
+
+    void start(uint8_t* bytes, uint64_t pos) {
+        out = bytes;
+        cursor = out + (pos >> 3);
+        used = pos & 7;
+        container = (uint64_t) *cursor << 56;
+    }
+
+    /* Make room in the buffer for at least count more bits, following its bytes if they move. */
+    void makeRoom(uint64_t count) {
+        uint64_t pos = position();
+        uint64_t room = pos - buffer->size() + max(count, BIT_WRITER_GROWTH);
+        out = buffer->prepareBits(room);
+        cursor = out + (pos >> 3);
+        limit = buffer->size() + room;
+    }
+};
+
+/* The EncodedData variant built on packed bit buffers. The leaves are kept in a string, one byte
+ * per leaf, in the same order as the EncodedData treeLeaves queue.
+ */
+struct PackedEncodedData {
+    BitBuffer treeShape;
+    string treeLeaves;
+    BitBuffer messageBits;
+    uint64_t symbolCount = 0;  // length of the original text, so decoding can size its output once
+};
+
+/* Hands out EncodingTreeNodes from one contiguous block and frees them all at once, when the
+ * arena is cleared or destroyed, in place of a new and delete per node. A Huffman tree over bytes
+ * has at most 2 * 256 - 1 nodes, so the default capacity holds any tree, and clearing the arena
+ * lets it be reused for tree after tree without touching the allocator again.
+ *
+ * Trees built in an arena must not be passed to deallocateTree.
+ */
+class TreeArena {
+public:
+    explicit TreeArena(int capacity = 511) {
+        nodes.reserve(capacity);
+    }
+
+    // A copy would hold pointers into the original's block, so arenas cannot be copied
+    TreeArena(const TreeArena&) = delete;
+    TreeArena& operator=(const TreeArena&) = delete;
+
+    EncodingTreeNode* newLeaf(char ch) {
+        checkCapacity();
+        nodes.emplace_back(ch);
+        return &nodes.back();
+    }
+
+    EncodingTreeNode* newParent(EncodingTreeNode* zero, EncodingTreeNode* one) {
+        checkCapacity();
+        nodes.emplace_back(zero, one);
+        return &nodes.back();
+    }
+
+    /* Free every node at once, keeping the block for the next tree. */
+    void clear() {
+        nodes.clear();
+    }
+
+    int size() const {
+        return nodes.size();
+    }
+
+private:
+    // The block never grows, since growing would move the nodes already handed out
+    void checkCapacity() {
+        if (nodes.size() == nodes.capacity())
+            error("TreeArena is out of nodes.");
+    }
+
+    vector<EncodingTreeNode> nodes;
+};
+
+/* Allocate a leaf in arena, or with new if arena is null.
+ */
+EncodingTreeNode* newLeaf(TreeArena* arena, char ch) {
+    return arena != nullptr ? arena->newLeaf(ch) : new EncodingTreeNode(ch);
+}
+
+/* Allocate a parent in arena, or with new if arena is null.
+ */
+EncodingTreeNode* newParent(TreeArena* arena, EncodingTreeNode* zero, EncodingTreeNode* one) {
+    return arena != nullptr ? arena->newParent(zero, one) : new EncodingTreeNode(zero, one);
+}
+
+/* Drain the bits queue into a new BitBuffer.
+ */
+BitBuffer packBits(Queue<Bit>& bits) {
+    BitBuffer packed;
+    packed.reserve(bits.size());
+    BitWriter writer(packed);
+    while (!bits.isEmpty()) {
+        writer.writeBit(bits.dequeue() == 1 ? 1 : 0);
+    }
+    writer.flush();
+    return packed;
+}
+
+/* Consume the unread bits of packed into a new Queue<Bit>.
+ */
+Queue<Bit> unpackBits(BitBuffer& packed) {
+    Queue<Bit> bits;
+    while (!packed.isEmpty()) {
+        bits.enqueue(packed.readBit());
+    }
+    return bits;
+}
+
+/* Number of message bits looked up at once by the table-driven decoder. A 2^10 entry table is
+ * 16 KB, which stays in L1 cache while still covering every code of a typical text in one lookup.
+ */
+const int DECODE_TABLE_BITS = 10;
+
+/* Most symbols a single decode table entry can hold, for windows packed with short codes.
+ */
+const int DECODE_MAX_SYMBOLS = 4;
+
+/* Table lookups made per BitReader refill. Each consumes at most DECODE_TABLE_BITS bits, so this
+ * many always fit in the bits a refill guarantees.
+ */
+const int DECODE_LOOKUPS_PER_REFILL = BIT_READER_REFILL_BITS / DECODE_TABLE_BITS;
+
+/* One entry of the decode table, indexed by the next DECODE_TABLE_BITS bits of the message.
+ * It holds every symbol whose code ends inside those bits and the number of bits they used.
+ * If no code ends inside the window (a code longer than DECODE_TABLE_BITS), symbolCount is 0
+ * and resume is the node reached after the window, from which the pointer walk finishes the code.
+ */
+struct DecodeEntry {
+    uint8_t symbols[DECODE_MAX_SYMBOLS];
+    uint8_t symbolCount;
+    uint8_t bitCount;
+    EncodingTreeNode* resume;
+};
+
+/* Builds the decode table for the given tree by walking every possible DECODE_TABLE_BITS bit
+ * window through the tree once, restarting at the root each time a leaf is reached. Reports an
+ * error if the tree is a single leaf, which has no codes to decode.
+ */
+vector<DecodeEntry> buildDecodeTable(EncodingTreeNode* tree) {
+    if (tree->isLeaf())
+        error("A decode table needs a tree with at least two leaves.");
+    vector<DecodeEntry> table(1 << DECODE_TABLE_BITS);
+    for (int window = 0; window < (1 << DECODE_TABLE_BITS); window++) {
+        DecodeEntry& entry = table[window];
+        entry.symbolCount = 0;
+        entry.bitCount = 0;
+        entry.resume = nullptr;
+        EncodingTreeNode* temp = tree;
+        for (int i = 0; i < DECODE_TABLE_BITS; i++) {
+            temp = ((window >> (DECODE_TABLE_BITS - 1 - i)) & 1) ? temp->one : temp->zero;
+            if (temp->isLeaf()) {
+                entry.symbols[entry.symbolCount++] = temp->getChar();
+                entry.bitCount = i + 1;
+                temp = tree;
+                if (entry.symbolCount == DECODE_MAX_SYMBOLS) break;
+            }
+        }
+        // No code ended inside the window, so remember where the walk got to
+        if (entry.symbolCount == 0) {
+            entry.bitCount = DECODE_TABLE_BITS;
+            entry.resume = temp;
+        }
+    }
+    return table;
+}
+
+/* Decodes the unread bits of reader into the capacity bytes at out using the decode table,
+ * consuming the bits it decodes, and returns the number of symbols written. Decoding stops early,
+ * at the end of a symbol, if out fills up. Each refill of the reader is followed by
+ * DECODE_LOOKUPS_PER_REFILL lookups with no further checks, each emitting every symbol that ends
+ * in the next DECODE_TABLE_BITS bits. Codes longer than that, the last few bits of the message and
+ * the last few bytes of out are finished by walking the tree one bit at a time.
+ */
+size_t decodeWithTable(EncodingTreeNode* tree, const vector<DecodeEntry>& table, BitReader& reader,
+                       char* out, size_t capacity) {
+    size_t length = 0;
+    while (reader.remaining() >= DECODE_LOOKUPS_PER_REFILL * DECODE_TABLE_BITS
+           && capacity - length >= DECODE_LOOKUPS_PER_REFILL * DECODE_MAX_SYMBOLS) {
+        reader.refill();
+        for (int i = 0; i < DECODE_LOOKUPS_PER_REFILL; i++) {
+            const DecodeEntry& entry = table[reader.peek(DECODE_TABLE_BITS)];
+            reader.consume(entry.bitCount);
+            if (entry.symbolCount == 0) {
+                // Long code: fall back to the pointer walk from where the table left off, then
+                // refill, since the walk may have used up the container. A tree can be deeper
+                // than the bits the round was sure of, so the walk stops at the end of the message
+                EncodingTreeNode* temp = entry.resume;
+                while (!temp->isLeaf()) {
+                    if (reader.isEmpty())
+                        error("Compressed message bits are corrupt.");
+                    temp = reader.readBit() ? temp->one : temp->zero;
+                }
+                out[length++] = temp->getChar();
+                break;
+            }
+            // Copying all the entry's slots is cheaper than copying just the used ones
+            memcpy(out + length, entry.symbols, DECODE_MAX_SYMBOLS);
+            length += entry.symbolCount;
+        }
+    }
+    // Too few bits or bytes remain for a round of lookups, so finish with the pointer walk
+    while (!reader.isEmpty() && length < capacity) {
+        EncodingTreeNode* temp = tree;
+        while (!temp->isLeaf() && !reader.isEmpty()) {
+            temp = reader.readBit() ? temp->one : temp->zero;
+        }
+        if (!temp->isLeaf()) break;
+        out[length++] = temp->getChar();
+    }
+    return length;
+}
+
+/* Like the BitReader version, but consuming the decoded bits of messageBits.
+ */
+size_t decodeWithTable(EncodingTreeNode* tree, const vector<DecodeEntry>& table, BitBuffer& messageBits,
+                       char* out, size_t capacity) {
+    BitReader reader(messageBits);
+    size_t length = decodeWithTable(tree, table, reader, out, capacity);
+    messageBits.seek(reader.position());
+    return length;
+}
+
+/* Decodes every unread bit of messageBits using the decode table, consuming them. The text grows
+ * by doubling, decoding straight into the unused part each time.
+ */
+string decodeWithTable(EncodingTreeNode* tree, const vector<DecodeEntry>& table, BitBuffer& messageBits) {
+    BitReader reader(messageBits);
+    string text = "";
+    size_t length = 0;
+    while (!reader.isEmpty()) {
+        text.resize(max<size_t>(2 * text.size(), 4096));
+        length += decodeWithTable(tree, table, reader, &text[length], text.size() - length);
+    }
+    text.resize(length);
+    messageBits.seek(reader.position());
+    return text;
+}
+
+/**
+ * Decode the unread bits of a packed messageBits buffer back to the original message text,
+ * consuming them. Same contract as the Queue<Bit> version below.
+ */
+string decodeText(EncodingTreeNode* tree, BitBuffer& messageBits) {
+    vector<DecodeEntry> table = buildDecodeTable(tree);
+    return decodeWithTable(tree, table, messageBits);
+}
+
 /**
  * Given a Queue<Bit> containing the compressed message bits and the encoding tree
  * used to encode those bits, decode the bits back to the original message text.
@@ -17,10 +654,23 @@ using namespace std;
  * You can assume that tree is a well-formed non-empty encoding tree and
  * messageBits queue contains a valid sequence of encoded bits.
  *
+ * The bits are packed into a BitBuffer and decoded DECODE_TABLE_BITS at a time through a lookup
+ * table built from the tree, which replaces a pointer chase and a branch per bit with one lookup
+ * per group of symbols.
+ */
+string decodeText(EncodingTreeNode* tree, Queue<Bit>& messageBits) {
+    BitBuffer packed = packBits(messageBits);
+    return decodeText(tree, packed);
+}
+
+/**
+ * Decodes the message one bit at a time by walking the tree. This is the original decoder,
+ * kept as the reference that the table-driven decodeText is checked and benchmarked against.
+ *
  * This function iteratively run throught the messageBits and creates the decoded text using the leafs of the
  * given tree.
  */
-string decodeText(EncodingTreeNode* tree, Queue<Bit>& messageBits) {
+string decodeTextByTreeWalk(EncodingTreeNode* tree, Queue<Bit>& messageBits) {
     string text = "";
     EncodingTreeNode* temp = tree;
     // Accomodates for the changing messageBits size
@@ -45,30 +695,98 @@ string decodeText(EncodingTreeNode* tree, Queue<Bit>& messageBits) {
     return text;
 }
 
+/* Recursive helper for unflattenTree, reading the tree's shape from reader and its leaves from
+ * treeLeaves starting at leafIndex, advancing both past the subtree. Nodes come from arena, or
+ * new if it is null.
+ *
+ * If the next bit is a 1, the node is a parent whose zero and one subtrees follow in turn;
+ * otherwise it is a leaf holding the next of the leaves. A tree of at most 256 leaves is at most
+ * 255 levels deep, so deeper nesting or running out of leaves reports an error rather than
+ * overflowing the stack or reading past treeLeaves.
+ */
+EncodingTreeNode* unflattenPacked(BitReader& treeShape, const string& treeLeaves, int& leafIndex, TreeArena* arena,
+                                  int depth = 0) {
+    if (treeShape.readBit() == 1) {
+        if (depth >= 255)
+            error("Flattened tree is too deep.");
+        // The zero subtree must be read first, so the two calls are sequenced explicitly rather
+        // than left to the unspecified order of constructor arguments
+        EncodingTreeNode* zero = unflattenPacked(treeShape, treeLeaves, leafIndex, arena, depth + 1);
+        EncodingTreeNode* one = unflattenPacked(treeShape, treeLeaves, leafIndex, arena, depth + 1);
+        return newParent(arena, zero, one);
+    }
+    if ((size_t) leafIndex >= treeLeaves.size())
+        error("Flattened tree has too few leaves.");
+    return newLeaf(arena, treeLeaves[leafIndex++]);
+}
+
+/* Shared body of the packed unflattenTree versions, consuming the tree's bits from treeShape.
+ */
+EncodingTreeNode* unflattenPacked(BitBuffer& treeShape, const string& treeLeaves, TreeArena* arena) {
+    BitReader reader(treeShape);
+    int leafIndex = 0;
+    EncodingTreeNode* tree = unflattenPacked(reader, treeLeaves, leafIndex, arena);
+    treeShape.seek(reader.position());
+    return tree;
+}
+
 /**
  * Reconstruct encoding tree from flattened form Queue<Bit> and Queue<char>.
  *
  * You can assume that the queues are well-formed and represent
  * a valid encoding tree.
  *
- * Recursively runs through the tree until all the Bits in treeShape have been visited. If the next Bit is a 1, then we recursively
- * run through the tree until we arrive at a 0, or a leaf, and add, or return, it to the tree.
+ * The queues are packed and the tree is read back through a BitReader, after which the bits and
+ * leaves the tree did not use are put back, so only the tree itself is consumed. An empty
+ * treeShape gives an empty tree.
+ *
+ * This shared body allocates nodes in arena, or with new if arena is null.
  */
-EncodingTreeNode* unflattenTree(Queue<Bit>& treeShape, Queue<char>& treeLeaves) {
+EncodingTreeNode* unflattenTree(Queue<Bit>& treeShape, Queue<char>& treeLeaves, TreeArena* arena) {
     // Assume tree is initially empty.
-    EncodingTreeNode* unFlatTree = nullptr;
-    if (treeShape.size() > 0) {
-        if (treeShape.dequeue() == 1) {
-            // Create a parent
-            unFlatTree = new EncodingTreeNode(unflattenTree(treeShape, treeLeaves), unflattenTree(treeShape, treeLeaves));
-        } else {
-            // Return child
-            return new EncodingTreeNode(treeLeaves.dequeue());
-        }
+    if (treeShape.isEmpty()) return nullptr;
+    BitBuffer packedShape = packBits(treeShape);
+    string leaves = "";
+    while (!treeLeaves.isEmpty()) {
+        leaves += treeLeaves.dequeue();
+    }
+    BitReader reader(packedShape);
+    int leafIndex = 0;
+    EncodingTreeNode* unFlatTree = unflattenPacked(reader, leaves, leafIndex, arena);
+    packedShape.seek(reader.position());
+    treeShape = unpackBits(packedShape);
+    for (size_t i = leafIndex; i < leaves.size(); i++) {
+        treeLeaves.enqueue(leaves[i]);
     }
     return unFlatTree;
 }
 
+EncodingTreeNode* unflattenTree(Queue<Bit>& treeShape, Queue<char>& treeLeaves) {
+    return unflattenTree(treeShape, treeLeaves, nullptr);
+}
+
+/**
+ * Reconstruct encoding tree from flattened form with its nodes allocated in arena.
+ */
+EncodingTreeNode* unflattenTree(Queue<Bit>& treeShape, Queue<char>& treeLeaves, TreeArena& arena) {
+    return unflattenTree(treeShape, treeLeaves, &arena);
+}
+
+/**
+ * Reconstruct encoding tree from the packed flattened form, consuming the tree's bits from
+ * treeShape. Same contract as the Queue version.
+ */
+EncodingTreeNode* unflattenTree(BitBuffer& treeShape, const string& treeLeaves) {
+    return unflattenPacked(treeShape, treeLeaves, nullptr);
+}
+
+/**
+ * Reconstruct encoding tree from the packed flattened form with its nodes allocated in arena.
+ */
+EncodingTreeNode* unflattenTree(BitBuffer& treeShape, const string& treeLeaves, TreeArena& arena) {
+    return unflattenPacked(treeShape, treeLeaves, &arena);
+}
+
 /**
  * Decompress the given EncodedData and return the original text.
  *
@@ -81,88 +799,558 @@ EncodingTreeNode* unflattenTree(Queue<Bit>& treeShape, Queue<char>& treeLeaves)
  *
  * Usign the previously implemented functions we can find the message from the data by unflattening the tree of
  * data and decoding the message of that unflatted tree. The new tree created must be allocated within the function as it is
- * initialized inside the function, not inputed.
+ * initialized inside the function, not inputed. Its nodes live in an arena freed on return.
  */
 string decompress(EncodedData& data) {
-    EncodingTreeNode* unFlatTree = unflattenTree(data.treeShape, data.treeLeaves);
-    string message = decodeText(unFlatTree, data.messageBits);
-    deallocateTree(unFlatTree);
-    return message;
+    TreeArena arena;
+    EncodingTreeNode* unFlatTree = unflattenTree(data.treeShape, data.treeLeaves, arena);
+    return decodeText(unFlatTree, data.messageBits);
 }
 
-/* This recursive helper function counts the frequency of the this specific parent given the children to have the
- * priority queue organize this frequency.
+/**
+ * Decompress the given PackedEncodedData and return the original text. Like the EncodedData
+ * version, this consumes the bits of data.
+ *
+ * The text is allocated at its recorded length up front and decoded straight into it. Reports an
+ * error if the bits do not decode to exactly data.symbolCount symbols.
  */
-int textFrequency(EncodingTreeNode* parent, Map<char, int> letterMap) {
-    if (parent->isLeaf()) {
-        return letterMap[parent->ch];
-    } else {
-        return textFrequency(parent->one, letterMap) + textFrequency(parent->zero, letterMap);
-    }
+string decompress(PackedEncodedData& data) {
+    TreeArena arena;
+    EncodingTreeNode* unFlatTree = unflattenTree(data.treeShape, data.treeLeaves, arena);
+    string text(data.symbolCount, '\0');
+    vector<DecodeEntry> table = buildDecodeTable(unFlatTree);
+    size_t length = decodeWithTable(unFlatTree, table, data.messageBits, &text[0], text.size());
+    if (length != text.size() || !data.messageBits.isEmpty())
+        error("Compressed message does not decode to its recorded length.");
+    return text;
 }
 
 /**
- * Constructs an optimal Huffman coding tree for the given text, using
- * the algorithm described in lecture.
+ * Decompress the given PackedEncodedData into the capacity bytes at out, consuming the bits of
+ * data, and return the length of the original text. Nothing is allocated for the text itself.
  *
- * Reports an error if the input text does not contain at least
- * two distinct characters.
- *
- * When assembling larger trees out of smaller ones, make sure to set the first
- * tree dequeued from the queue to be the zero subtree of the new tree and the
- * second tree as the one subtree.
- *
- * This function maps the text, with keys as its characters and values as their respective frequency.
- * This map is then added to a priority queue, organizing the letter by their frequency. The
- * tree is then built by removing two nodes ,from this priority queue, at a time, as there are can only
- * be two children or no children,  and having a parent node of those two. This parent node is added to a
- * the priority queue and and organized until all the children have been put into the queue of size one.
+ * Reports an error if the text does not fit in capacity bytes.
  */
-EncodingTreeNode* buildHuffmanTree(string text) {
-    PriorityQueue<EncodingTreeNode*> treeQueue;
-    Map<char, int> letterMap;
-    // Create frequency map
-    for (int i = 0; i < text.size(); i++) {
-        if (letterMap.containsKey(text[i])) {
-            letterMap[text[i]] += 1;
-        } else {
-            letterMap[text[i]] = 1;
-        }
-    }
-    // Add letters and organize them by frequency using priority queue
-    for (char letter : letterMap) {
-        treeQueue.enqueue(new EncodingTreeNode(letter), letterMap[letter]);
+size_t decompress(PackedEncodedData& data, char* out, size_t capacity) {
+    TreeArena arena;
+    EncodingTreeNode* unFlatTree = unflattenTree(data.treeShape, data.treeLeaves, arena);
+    vector<DecodeEntry> table = buildDecodeTable(unFlatTree);
+    size_t length = decodeWithTable(unFlatTree, table, data.messageBits, out, capacity);
+    if (!data.messageBits.isEmpty())
+        error("Output buffer is too small for the decompressed text.");
+    return length;
+}
+
+/* Inputs shorter than this are counted with a single histogram; the interleaved kernels only
+ * pay off once their four tables have been warmed up and need summing.
+ */
+const size_t INTERLEAVED_HISTOGRAM_MIN = 4096;
+
+/* Bytes a histogram kernel counts at a time. The kernels count into 32-bit sub-histograms, half
+ * the cache footprint of 64-bit ones, and no counter can reach 2^32 within a segment.
+ */
+const size_t HISTOGRAM_SEGMENT = (size_t) 1 << 30;
+
+/* A histogram kernel adds the byte counts of a segment into four zeroed 32-bit sub-histograms.
+ * How the counts are spread over the four does not matter, since they are summed afterwards, so
+ * every kernel gives exactly the same totals.
+ */
+typedef void (*HistogramKernel)(const uint8_t* bytes, size_t length, uint32_t tables[4][256]);
+
+/* Long runs of the same byte make a single histogram stall, because each increment has to wait
+ * for the previous store to the same counter. This kernel reads eight bytes at a time and spreads
+ * them over the four sub-histograms, so consecutive bytes update different counters.
+ */
+inline void countInterleaved(const uint8_t* bytes, size_t length, uint32_t tables[4][256]) {
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, bytes + i, sizeof(word));
+        tables[0][word & 0xFF]++;
+        tables[1][(word >> 8) & 0xFF]++;
+        tables[2][(word >> 16) & 0xFF]++;
+        tables[3][(word >> 24) & 0xFF]++;
+        tables[0][(word >> 32) & 0xFF]++;
+        tables[1][(word >> 40) & 0xFF]++;
+        tables[2][(word >> 48) & 0xFF]++;
+        tables[3][word >> 56]++;
+    }
+    for (; i < length; i++) {
+        tables[0][bytes[i]]++;
+    }
+}
+
+void countFrequenciesScalar(const uint8_t* bytes, size_t length, uint32_t tables[4][256]) {
+    countInterleaved(bytes, length, tables);
+}
+
+/* The vector kernels load a whole register of bytes at a time and compare it with its first byte
+ * broadcast. A register of one repeated byte, the case that stalls a histogram most, is then
+ * counted with a single add; any other register goes through the interleaved kernel. Histograms
+ * have no scatter, so mixed data gains only the wide loads.
+ */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HUFFMAN_X86_HISTOGRAMS
+
+__attribute__((target("sse2")))
+void countFrequenciesSse2(const uint8_t* bytes, size_t length, uint32_t tables[4][256]) {
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes + i));
+        __m128i first = _mm_set1_epi8(bytes[i]);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, first)) == 0xFFFF) {
+            tables[0][bytes[i]] += 16;
+        } else {
+            countInterleaved(bytes + i, 16, tables);
+        }
+    }
+    countInterleaved(bytes + i, length - i, tables);
+}
+
+__attribute__((target("avx2")))
+void countFrequenciesAvx2(const uint8_t* bytes, size_t length, uint32_t tables[4][256]) {
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(bytes + i));
+        __m256i first = _mm256_set1_epi8(bytes[i]);
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, first)) == -1) {
+            tables[0][bytes[i]] += 32;
+        } else {
+            countInterleaved(bytes + i, 32, tables);
+        }
+    }
+    countInterleaved(bytes + i, length - i, tables);
+}
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define HUFFMAN_NEON_HISTOGRAMS
+
+void countFrequenciesNeon(const uint8_t* bytes, size_t length, uint32_t tables[4][256]) {
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        uint8x16_t chunk = vld1q_u8(bytes + i);
+        if (vminvq_u8(vceqq_u8(chunk, vdupq_n_u8(bytes[i]))) == 0xFF) {
+            tables[0][bytes[i]] += 16;
+        } else {
+            countInterleaved(bytes + i, 16, tables);
+        }
+    }
+    countInterleaved(bytes + i, length - i, tables);
+}
+#endif
+
+/* A histogram kernel and the name it is reported under. */
+struct NamedHistogramKernel {
+    string name;
+    HistogramKernel kernel;
+};
+
+/* Returns every histogram kernel the running processor supports, the scalar one first.
+ */
+Vector<NamedHistogramKernel> availableHistogramKernels() {
+    Vector<NamedHistogramKernel> kernels = { { "scalar", countFrequenciesScalar } };
+#ifdef HUFFMAN_X86_HISTOGRAMS
+    if (__builtin_cpu_supports("sse2")) kernels.add({ "sse2", countFrequenciesSse2 });
+    if (__builtin_cpu_supports("avx2")) kernels.add({ "avx2", countFrequenciesAvx2 });
+#endif
+#ifdef HUFFMAN_NEON_HISTOGRAMS
+    kernels.add({ "neon", countFrequenciesNeon });
+#endif
+    return kernels;
+}
+
+/* Counts the bytes with the given kernel, one segment at a time, adding the counts into counts.
+ */
+void countFrequenciesWith(HistogramKernel kernel, const uint8_t* bytes, size_t length, uint64_t counts[256]) {
+    uint32_t tables[4][256];
+    for (size_t offset = 0; offset < length; offset += HISTOGRAM_SEGMENT) {
+        memset(tables, 0, sizeof(tables));
+        kernel(bytes + offset, min(HISTOGRAM_SEGMENT, length - offset), tables);
+        for (int symbol = 0; symbol < 256; symbol++) {
+            counts[symbol] += (uint64_t) tables[0][symbol] + tables[1][symbol] + tables[2][symbol] + tables[3][symbol];
+        }
+    }
+}
+
+/* Bytes at the start of an input that selectHistogramKernel samples, and the block it checks
+ * for a single repeated byte, the widest register a vector kernel counts with one add.
+ */
+const size_t HISTOGRAM_SAMPLE = 4096;
+const size_t HISTOGRAM_RUN_BLOCK = 32;
+
+/* Returns whether at least a quarter of the 32-byte blocks in the first 4 KB of bytes repeat a
+ * single byte, comparing each block with itself shifted by one. Text and binary data have almost
+ * none, while runs averaging a few dozen bytes already fill a third of them.
+ */
+bool startsWithRuns(const uint8_t* bytes, size_t length) {
+    size_t sample = min(length, HISTOGRAM_SAMPLE);
+    size_t blocks = 0;
+    size_t uniform = 0;
+    for (size_t i = 0; i + HISTOGRAM_RUN_BLOCK <= sample; i += HISTOGRAM_RUN_BLOCK) {
+        blocks++;
+        if (memcmp(bytes + i, bytes + i + 1, HISTOGRAM_RUN_BLOCK - 1) == 0) uniform++;
+    }
+    return blocks > 0 && 4 * uniform >= blocks;
+}
+
+/* Picks the histogram kernel for an input from its first bytes and the processor's features, so
+ * the same input on the same machine is always counted with the same kernel. On mixed bytes the
+ * vector kernels gain nothing and AVX2 measured slower than scalar on text, so the scalar kernel
+ * is used. When the input starts with long runs, where every vector kernel is two to four times
+ * faster than scalar, AVX2 is picked, then NEON, then SSE2.
+ */
+NamedHistogramKernel selectHistogramKernel(const uint8_t* bytes, size_t length) {
+    static const Vector<NamedHistogramKernel> kernels = availableHistogramKernels();
+    if (startsWithRuns(bytes, length)) {
+        for (string preferred : { "avx2", "neon", "sse2" }) {
+            for (const NamedHistogramKernel& named : kernels) {
+                if (named.name == preferred) return named;
+            }
+        }
+    }
+    return kernels[0];
+}
+
+/* Counts how many times each byte value occurs in bytes, adding the counts into counts. Large
+ * inputs go to the kernel selectHistogramKernel picks for them.
+ */
+void countFrequencies(const uint8_t* bytes, size_t length, uint64_t counts[256]) {
+    if (length < INTERLEAVED_HISTOGRAM_MIN) {
+        for (size_t i = 0; i < length; i++) {
+            counts[bytes[i]]++;
+        }
+        return;
+    }
+    countFrequenciesWith(selectHistogramKernel(bytes, length).kernel, bytes, length, counts);
+}
+
+/* Builds the Huffman tree for the given byte counts, as buildHuffmanTree does after counting
+ * its text. Nodes are allocated in arena, or with new if arena is null. Reports an error if every
+ * count is 0.
+ */
+EncodingTreeNode* buildHuffmanTreeFromCounts(const uint64_t counts[256], TreeArena* arena) {
+    PriorityQueue<EncodingTreeNode*> treeQueue;
+    // Add letters and organize them by frequency using priority queue. Letters are visited in
+    // byte order, 0 to 255, so ties break the same way whether or not char is signed.
+    for (int letter = 0; letter < 256; letter++) {
+        uint64_t count = counts[letter];
+        if (count > 0) {
+            treeQueue.enqueue(newLeaf(arena, (char) letter), count);
+        }
     }
-    // Add children to parent and organize by priority using priority queue
+    if (treeQueue.isEmpty())
+        error("A Huffman tree needs at least one character.");
+    // Add children to parent and organize by priority using priority queue. Each subtree's
+    // priority is its total frequency, so a parent's is just the sum of its children's.
     while (treeQueue.size() >= 2) {
+        double leftFrequency = treeQueue.peekPriority();
         EncodingTreeNode* leftNode = treeQueue.dequeue();
+        double rightFrequency = treeQueue.peekPriority();
         EncodingTreeNode* rightNode = treeQueue.dequeue();
-        EncodingTreeNode* parent = new EncodingTreeNode(leftNode, rightNode);
-        int totFrequency = textFrequency(parent, letterMap);
-        treeQueue.enqueue(parent, totFrequency);
+        EncodingTreeNode* parent = newParent(arena, leftNode, rightNode);
+        treeQueue.enqueue(parent, leftFrequency + rightFrequency);
     }
     // Only one parent, with all the rest of the tree will remain, hence we only return the one value in the priority queue
     return treeQueue.dequeue();
 }
 
-/* This helper function traverses through the tree, adding the locations of the leaf nodes to the letterMap
+/**
+ * Constructs an optimal Huffman coding tree for the given text, using
+ * the algorithm described in lecture.
+ *
+ * Reports an error if the input text does not contain at least
+ * two distinct characters.
+ *
+ * When assembling larger trees out of smaller ones, make sure to set the first
+ * tree dequeued from the queue to be the zero subtree of the new tree and the
+ * second tree as the one subtree.
+ *
+ * This function counts the frequency of each character of the text in a flat histogram.
+ * These counts are then added to a priority queue, organizing the letter by their frequency. The
+ * tree is then built by removing two nodes ,from this priority queue, at a time, as there are can only
+ * be two children or no children,  and having a parent node of those two. This parent node is added to a
+ * the priority queue and and organized until all the children have been put into the queue of size one.
+ *
+ * This shared body allocates nodes in arena, or with new if arena is null.
+ */
+EncodingTreeNode* buildHuffmanTree(string_view text, TreeArena* arena) {
+    // Count every byte in one pass over the text
+    uint64_t counts[256] = { 0 };
+    countFrequencies(reinterpret_cast<const uint8_t*>(text.data()), text.size(), counts);
+    return buildHuffmanTreeFromCounts(counts, arena);
+}
+
+/**
+ * Constructs the same Huffman tree as buildHuffmanTree without copying text.
+ */
+EncodingTreeNode* buildHuffmanTree(string_view text) {
+    return buildHuffmanTree(text, nullptr);
+}
+
+EncodingTreeNode* buildHuffmanTree(string text) {
+    return buildHuffmanTree(string_view(text));
+}
+
+/* Keeps calls with a string literal from being ambiguous between the string and string_view
+ * versions.
+ */
+EncodingTreeNode* buildHuffmanTree(const char* text) {
+    return buildHuffmanTree(string_view(text));
+}
+
+/**
+ * Constructs the same Huffman tree as buildHuffmanTree with its nodes allocated in arena.
+ */
+EncodingTreeNode* buildHuffmanTree(string_view text, TreeArena& arena) {
+    return buildHuffmanTree(text, &arena);
+}
+
+/* The merges of a Huffman tree construction, stored in flat arrays instead of tree nodes. Node
+ * indices 0 to leafCount - 1 are the leaves in order of increasing weight, and node leafCount + i
+ * is the parent made by the i-th merge, with children zero[i] and one[i]. The root is the last
+ * parent, node 2 * leafCount - 2.
+ */
+struct HuffmanMerges {
+    int leafCount;
+    uint8_t leafSymbols[256];
+    uint64_t weights[511];
+    int zero[255];
+    int one[255];
+};
+
+/* Merges the leaves for the given symbol counts with the two-queue method. Once the leaves are
+ * sorted by weight, every parent is at least as heavy as the one made before it, so the parents
+ * form a second sorted queue and the two lightest subtrees are always at the front of the two
+ * queues. That replaces every heap operation with a comparison and allocates nothing.
+ *
+ * As in buildHuffmanTree, the first subtree taken becomes the zero child. Equal-weight leaves are
+ * taken in byte order, and a parent is taken before a leaf of equal weight.
+ */
+void mergeTwoQueues(const uint64_t counts[256], HuffmanMerges& merges) {
+    int leafCount = 0;
+    for (int letter = 0; letter < 256; letter++) {
+        if (counts[letter] > 0) {
+            merges.leafSymbols[leafCount++] = letter;
+        }
+    }
+    stable_sort(merges.leafSymbols, merges.leafSymbols + leafCount, [&](uint8_t a, uint8_t b) {
+        return counts[a] < counts[b];
+    });
+    for (int i = 0; i < leafCount; i++) {
+        merges.weights[i] = counts[merges.leafSymbols[i]];
+    }
+    merges.leafCount = leafCount;
+    int nextLeaf = 0;
+    int nextParent = leafCount;
+    int parentCount = 0;
+    // Take whichever queue front is lighter, preferring parents on ties
+    auto takeLightest = [&]() {
+        if (nextLeaf < leafCount && (nextParent == leafCount + parentCount
+                                     || merges.weights[nextLeaf] < merges.weights[nextParent])) {
+            return nextLeaf++;
+        }
+        return nextParent++;
+    };
+    for (int i = 0; i < leafCount - 1; i++) {
+        int zero = takeLightest();
+        int one = takeLightest();
+        merges.zero[i] = zero;
+        merges.one[i] = one;
+        merges.weights[leafCount + i] = merges.weights[zero] + merges.weights[one];
+        parentCount++;
+    }
+}
+
+/* Computes each symbol's code length (its leaf's depth) from the merges, walking the parents from
+ * the root down. A single symbol gets a 1-bit code.
+ */
+void codeLengthsFromMerges(const HuffmanMerges& merges, int codeLengths[256]) {
+    int depths[511] = { 0 };
+    for (int i = merges.leafCount - 2; i >= 0; i--) {
+        int depth = depths[merges.leafCount + i] + 1;
+        depths[merges.zero[i]] = depth;
+        depths[merges.one[i]] = depth;
+    }
+    for (int i = 0; i < merges.leafCount; i++) {
+        codeLengths[merges.leafSymbols[i]] = max(depths[i], 1);
+    }
+}
+
+/**
+ * Constructs an optimal Huffman coding tree for the given text with the two-queue method
+ * instead of a priority queue. The tree has the same cost as buildHuffmanTree's, and the same
+ * shape whenever the priority queue breaks ties the same way.
+ *
+ * Reports an error if the input text does not contain at least
+ * two distinct characters. Nodes are allocated in arena, or with new if arena is null.
+ */
+EncodingTreeNode* buildHuffmanTreeTwoQueue(string_view text, TreeArena* arena) {
+    uint64_t counts[256] = { 0 };
+    countFrequencies(reinterpret_cast<const uint8_t*>(text.data()), text.size(), counts);
+    HuffmanMerges merges;
+    mergeTwoQueues(counts, merges);
+    if (merges.leafCount < 2)
+        error("Input to be compressed shoudl contain at least two distinct characters to be Huffman-encodable.");
+    EncodingTreeNode* nodes[511];
+    for (int i = 0; i < merges.leafCount; i++) {
+        nodes[i] = newLeaf(arena, (char) merges.leafSymbols[i]);
+    }
+    for (int i = 0; i < merges.leafCount - 1; i++) {
+        nodes[merges.leafCount + i] = newParent(arena, nodes[merges.zero[i]], nodes[merges.one[i]]);
+    }
+    return nodes[2 * merges.leafCount - 2];
+}
+
+EncodingTreeNode* buildHuffmanTreeTwoQueue(string_view text) {
+    return buildHuffmanTreeTwoQueue(text, nullptr);
+}
+
+EncodingTreeNode* buildHuffmanTreeTwoQueue(string_view text, TreeArena& arena) {
+    return buildHuffmanTreeTwoQueue(text, &arena);
+}
+
+/* A symbol's code, right-aligned in bits, and its length in bits.
  */
-void traverse(EncodingTreeNode* &tree, string &location, Map<char, string> &letterMap) {
-    EncodingTreeNode* tempTree = tree;
-    // Add character key and its location value
-    if (tempTree->isLeaf()) {
-        letterMap[tempTree->getChar()] = location;
+struct SymbolCode {
+    uint64_t bits;
+    int length;
+};
+
+/* This helper function traverses through the tree, recording the code of each leaf in the flat
+ * codes table indexed by byte value. code holds the path taken so far, one bit per level.
+ */
+void traverse(EncodingTreeNode* tree, uint64_t code, int length, SymbolCode codes[256]) {
+    if (tree->isLeaf()) {
+        codes[(uint8_t) tree->getChar()] = { code, length };
+    } else {
+        if (length >= 64)
+            error("Huffman code lengths above 64 bits are not supported.");
+        traverse(tree->zero, code << 1, length + 1, codes);
+        traverse(tree->one, (code << 1) | 1, length + 1, codes);
+    }
+}
+
+/* Builds the table of every leaf's code for the given tree. Symbols not in the tree get length 0.
+ */
+void buildCodeTable(EncodingTreeNode* tree, SymbolCode codes[256]) {
+    for (int symbol = 0; symbol < 256; symbol++) {
+        codes[symbol] = { 0, 0 };
+    }
+    traverse(tree, 0, 0, codes);
+}
+
+/* Symbols encoded at a time by the BitBuffer version of encodeWithCodes, bounding what each
+ * round prepares in the buffer to a chunk's worth of the longest code.
+ */
+const size_t ENCODE_CHUNK = 1 << 16;
+
+/* Longest code encodeInto handles, so that its table entries are two 32-bit halves and a lookup
+ * is one 8-byte load.
+ */
+const int ENCODE_SHORT_CODE_BITS = 32;
+
+/* A code of at most ENCODE_SHORT_CODE_BITS bits, as stored in encodeInto's table. */
+struct ShortCode {
+    uint32_t bits;
+    uint32_t length;
+};
+
+/* Encodes the length bytes with codes through writer, which must have room for them all. Each
+ * group of SymbolsPerStore codes is first joined into one right-aligned group, which depends only
+ * on the codes themselves, and the group is then stored with one write. No code may be longer
+ * than BIT_WRITER_STORE_BITS / SymbolsPerStore bits.
+ */
+template <int SymbolsPerStore>
+void encodeInto(const ShortCode codes[256], const uint8_t* bytes, size_t length, BitWriter& writer) {
+    size_t i = 0;
+    for (; i + SymbolsPerStore <= length; i += SymbolsPerStore) {
+        uint64_t group = 0;
+        uint64_t bits = 0;
+        for (int k = 0; k < SymbolsPerStore; k++) {
+            ShortCode code = codes[bytes[i + k]];
+            group = (group << code.length) | code.bits;
+            bits += code.length;
+        }
+        writer.storeBits(group, bits);
+    }
+    for (; i < length; i++) {
+        writer.storeBits(codes[bytes[i]].bits, codes[bytes[i]].length);
+    }
+}
+
+/* Returns the length of the longest code in codes, and at least 1.
+ */
+int longestCode(const SymbolCode codes[256]) {
+    int longest = 1;
+    for (int symbol = 0; symbol < 256; symbol++) {
+        longest = max(longest, codes[symbol].length);
+    }
+    return longest;
+}
+
+/* Encodes the length bytes with codes into the packed bit stream at out, starting at bit pos,
+ * and returns the bit position after the last code, so a caller that knows the encoded size can
+ * encode into memory it owns, such as a mapped file. Codes of up to ENCODE_SHORT_CODE_BITS bits
+ * go through encodeInto, as many to a store as the longest code allows; longer ones go through
+ * writeBits. The same conditions on out as for a BitWriter writing into memory apply.
+ */
+uint64_t encodeWithCodes(const SymbolCode codes[256], const uint8_t* bytes, size_t length, uint8_t* out, uint64_t pos) {
+    BitWriter writer(out, pos);
+    int longest = longestCode(codes);
+    if (longest > ENCODE_SHORT_CODE_BITS) {
+        for (size_t i = 0; i < length; i++) {
+            writer.writeBits(codes[bytes[i]].bits, codes[bytes[i]].length);
+        }
+        return writer.position();
+    }
+    ShortCode shortCodes[256];
+    for (int symbol = 0; symbol < 256; symbol++) {
+        shortCodes[symbol] = { (uint32_t) codes[symbol].bits, (uint32_t) codes[symbol].length };
+    }
+    int symbolsPerStore = BIT_WRITER_STORE_BITS / longest;
+    if (symbolsPerStore >= 4) {
+        encodeInto<4>(shortCodes, bytes, length, writer);
+    } else if (symbolsPerStore == 3) {
+        encodeInto<3>(shortCodes, bytes, length, writer);
+    } else if (symbolsPerStore == 2) {
+        encodeInto<2>(shortCodes, bytes, length, writer);
     } else {
-        tempTree = tempTree->zero;
-        location += '0';
-        traverse(tempTree, location, letterMap);
-        tempTree = tree;
-        location.erase(location.size() - 1, 1);
-        tempTree = tempTree->one;
-        location += '1';
-        traverse(tempTree, location, letterMap);
-        location.erase(location.size() - 1, 1);
+        encodeInto<1>(shortCodes, bytes, length, writer);
+    }
+    return writer.position();
+}
+
+/* Appends the code of each of the length bytes to messageBits, encoding a chunk at a time
+ * straight into the buffer's bytes.
+ */
+void encodeWithCodes(const SymbolCode codes[256], const uint8_t* bytes, size_t length, BitBuffer& messageBits) {
+    int longest = longestCode(codes);
+    for (size_t start = 0; start < length; start += ENCODE_CHUNK) {
+        size_t count = min(ENCODE_CHUNK, length - start);
+        uint8_t* out = messageBits.prepareBits(count * longest);
+        uint64_t pos = messageBits.size();
+        messageBits.commitBits(encodeWithCodes(codes, bytes + start, count, out, pos) - pos);
+    }
+}
+
+/* Returns the number of bits the codes take to encode bytes with the given counts.
+ */
+uint64_t encodedBits(const uint64_t counts[256], const SymbolCode codes[256]) {
+    uint64_t bits = 0;
+    for (int symbol = 0; symbol < 256; symbol++) {
+        bits += counts[symbol] * codes[symbol].length;
     }
+    return bits;
+}
+
+/**
+ * Encode text with the tree, appending the bits to the packed messageBits buffer.
+ */
+void encodeText(EncodingTreeNode* tree, string_view text, BitBuffer& messageBits) {
+    SymbolCode codes[256];
+    buildCodeTable(tree, codes);
+    encodeWithCodes(codes, reinterpret_cast<const uint8_t*>(text.data()), text.size(), messageBits);
 }
 
 /**
@@ -172,22 +1360,45 @@ void traverse(EncodingTreeNode* &tree, string &location, Map<char, string> &lett
  * You can assume tree is a valid non-empty encoding tree and contains an
  * encoding for every character in the text.
  *
- * Using the map with the keys as the leaf nodes, and the values as their locations relative to the tree,
- * we create the text by accessing the location of each character in order and add it to a queue until
- * all the letters have been looped through and the locations all enqueued.
+ * Using a flat table with the code of every leaf, we write the codes of the characters in order
+ * into a packed buffer, several whole codes at a time, and only then unpack the bits into the queue.
  */
+Queue<Bit> encodeText(EncodingTreeNode* tree, string_view text) {
+    BitBuffer packed;
+    encodeText(tree, text, packed);
+    return unpackBits(packed);
+}
+
 Queue<Bit> encodeText(EncodingTreeNode* tree, string text) {
-    Map<char, string> letterMap;
-    string location = "";
-    // Create map of letters and their locations
-    traverse(tree, location, letterMap);
-    Queue<Bit> encoded;
-    for (char letter: text) {
-        for (int i = 0; i < letterMap[letter].size(); i++)
-            // Enqueue each bit of location of that respective letter
-            encoded.enqueue(charToInteger(letterMap[letter][i]));
+    return encodeText(tree, string_view(text));
+}
+
+Queue<Bit> encodeText(EncodingTreeNode* tree, const char* text) {
+    return encodeText(tree, string_view(text));
+}
+
+/* Recursive helper for flattenTree, writing a 0 for a leaf and a 1 for a parent followed by its
+ * zero and then its one subtree, and appending each leaf's character to treeLeaves in that order.
+ */
+void flattenPacked(EncodingTreeNode* tree, BitWriter& treeShape, string& treeLeaves) {
+    if (tree->isLeaf()) {
+        treeShape.writeBit(0);
+        treeLeaves += tree->ch;
+    } else {
+        treeShape.writeBit(1);
+        flattenPacked(tree->zero, treeShape, treeLeaves);
+        flattenPacked(tree->one, treeShape, treeLeaves);
     }
-    return encoded;
+}
+
+/**
+ * Flatten the given tree into a packed treeShape buffer and a string of leaves, in the same
+ * order as the Queue version.
+ */
+void flattenTree(EncodingTreeNode* tree, BitBuffer& treeShape, string& treeLeaves) {
+    BitWriter writer(treeShape);
+    flattenPacked(tree, writer, treeLeaves);
+    writer.flush();
 }
 
 /**
@@ -198,19 +1409,18 @@ Queue<Bit> encodeText(EncodingTreeNode* tree, string text) {
  *
  * You can assume tree is a valid well-formed encoding tree.
  *
- * Create a flat version of the tree by traversing through the tree and adding a 0 if there is a leaf and a 1
- * if not, going from the left node to the right node recursively.
+ * The tree is flattened into the packed form through a BitWriter, and the bits and leaves are
+ * then added to the queues.
  */
 void flattenTree(EncodingTreeNode* tree, Queue<Bit>& treeShape, Queue<char>& treeLeaves) {
-    EncodingTreeNode* tempTree = tree;
-    if (tempTree->isLeaf()) {
-        treeShape.enqueue(0);
-        treeLeaves.enqueue(tempTree->ch);
-    } else {
-        // Enqueue bit 1 as this tree root was not a leaf
-        treeShape.enqueue(1);
-        flattenTree(tempTree->zero, treeShape, treeLeaves);
-        flattenTree(tempTree->one, treeShape, treeLeaves);
+    BitBuffer packedShape;
+    string leaves = "";
+    flattenTree(tree, packedShape, leaves);
+    while (!packedShape.isEmpty()) {
+        treeShape.enqueue(packedShape.readBit());
+    }
+    for (char leaf : leaves) {
+        treeLeaves.enqueue(leaf);
     }
 }
 
@@ -227,85 +1437,2858 @@ void flattenTree(EncodingTreeNode* tree, Queue<Bit>& treeShape, Queue<char>& tre
  * tree shape is. We then add this new tree leaf and shape data into the data tree and add the message of the given
  * text using the tree.
  */
-EncodedData compress(string messageText) {
+EncodedData compress(string_view messageText) {
     if (messageText.size() < 2)
         error("Input to be compressed shoudl contain at least two distinct characters to be Huffman-encodable.");
     EncodedData tree;
-    Queue<Bit> treeShape;
-    Queue<char> treeLeaves;
-    EncodingTreeNode* huffmanTree = buildHuffmanTree(messageText);
-    flattenTree(huffmanTree, treeShape, treeLeaves);
+    TreeArena arena;
+    EncodingTreeNode* huffmanTree = buildHuffmanTree(messageText, arena);
+    // A text of one repeated character builds a lone leaf, which has no code to send
+    if (huffmanTree->isLeaf())
+        error("Input to be compressed shoudl contain at least two distinct characters to be Huffman-encodable.");
+    flattenTree(huffmanTree, tree.treeShape, tree.treeLeaves);
     tree.messageBits = encodeText(huffmanTree, messageText);
-    tree.treeLeaves = treeLeaves;
-    tree.treeShape = treeShape;
-    deallocateTree(huffmanTree);
     return tree;
 }
 
-/* * * * * * Testing Helper Functions Below This Point * * * * * */
-
-/* Manually create the leaf nodes and parent nodes of the given example tree
+/* The version declared in huffman.h. Its parameter is the only copy of the text made; pass a
+ * string_view to avoid even that.
  */
-EncodingTreeNode* createExampleTree() {
-    /* Example encoding tree used in multiple test cases:
-     *                *
-     *              /   \
-     *             T     *
-     *                  / \
-     *                 *   E
-     *                / \
-     *               R   S
-     */
-    EncodingTreeNode* charT = new EncodingTreeNode('T');
-    EncodingTreeNode* charR = new EncodingTreeNode('R');
-    EncodingTreeNode* charS = new EncodingTreeNode('S');
-    EncodingTreeNode* charE = new EncodingTreeNode('E');
-    EncodingTreeNode* parRS = new EncodingTreeNode(charR, charS);
-    EncodingTreeNode* parE = new EncodingTreeNode(parRS, charE);
-    EncodingTreeNode* par = new EncodingTreeNode(charT, parE);
-    return par;
+EncodedData compress(string messageText) {
+    return compress(string_view(messageText));
 }
 
-/* Run through each node, in the zero and one direction, deleting each node as it traverses.
+EncodedData compress(const char* messageText) {
+    return compress(string_view(messageText));
+}
+
+/**
+ * Compress the input text into a PackedEncodedData, which holds the same tree shape, leaves and
+ * message bits as compress but packed one bit per bit.
+ *
+ * Reports an error if the message text does not contain at least
+ * two distinct characters.
  */
-void deallocateTree(EncodingTreeNode* t) {
-      if (t->isLeaf() == false) {
-        if (t->zero != nullptr) deallocateTree(t->zero);
-        if (t->one != nullptr) deallocateTree(t->one);
-      }
-      delete t;
+PackedEncodedData compressPacked(string_view messageText) {
+    if (messageText.size() < 2)
+        error("Input to be compressed shoudl contain at least two distinct characters to be Huffman-encodable.");
+    PackedEncodedData data;
+    TreeArena arena;
+    EncodingTreeNode* huffmanTree = buildHuffmanTree(messageText, arena);
+    if (huffmanTree->isLeaf())
+        error("Input to be compressed shoudl contain at least two distinct characters to be Huffman-encodable.");
+    flattenTree(huffmanTree, data.treeShape, data.treeLeaves);
+    encodeText(huffmanTree, messageText, data.messageBits);
+    data.symbolCount = messageText.size();
+    return data;
 }
 
-/* Check that the two trees are identical.
+/* * * * * * Compact Array Trees * * * * * */
+
+/* Flag marking a CompactTree child as a leaf, with the leaf's symbol in the low byte.
  */
-bool areEqual(EncodingTreeNode* a, EncodingTreeNode* b) {
-    // Check if one of the equal positioned nodes is a leaf and the other it not
-    if (a->isLeaf() && !b->isLeaf())
-        return false;
-    if (!a->isLeaf() && b->isLeaf())
-        return false;
-    // Check if the equal positioned leaves have different characters assigned to them
-    else if (a->isLeaf() && b->isLeaf()) {
-        if (a->getChar() != b->getChar()) {
-            return false;
-        }
-    }
-    else {
-        // Recurse through the trees as long as they are not nullptrs
-        if (a->zero != nullptr && b->zero != nullptr)
-            areEqual(a->zero, b->zero);
-        if (a->one != nullptr && b->one != nullptr)
-            areEqual(a->one, b->one);
-        // If one of the two is a nullptr and the other isnt, return false
-        if (a->zero == nullptr && b->zero != nullptr)
-            return !(a->zero != nullptr && b->zero == nullptr);
-        if (a->one == nullptr && b->one != nullptr)
-            return !(a->one != nullptr && b->one == nullptr);
+const uint16_t COMPACT_LEAF = 0x8000;
+
+/* An encoding tree stored as one array of its internal nodes, each holding its two children as
+ * 16-bit values: the index of an internal child, or COMPACT_LEAF plus the symbol of a leaf child.
+ * A byte alphabet has at most 255 internal nodes, so the whole tree is at most 1020 bytes, and a
+ * walk down it touches nothing outside those few cache lines. Node 0 is the root.
+ */
+struct CompactTree {
+    uint16_t children[255][2];
+    int nodeCount = 0;
+};
+
+/* Copies the subtree rooted at node into compact, returning its child value.
+ */
+uint16_t compactSubtree(EncodingTreeNode* node, CompactTree& compact) {
+    if (node->isLeaf()) {
+        return COMPACT_LEAF | (uint8_t) node->getChar();
     }
-    return true;
+    int index = compact.nodeCount++;
+    uint16_t zero = compactSubtree(node->zero, compact);
+    uint16_t one = compactSubtree(node->one, compact);
+    compact.children[index][0] = zero;
+    compact.children[index][1] = one;
+    return index;
 }
 
-/* * * * * * Test Cases Below This Point * * * * * */
+/**
+ * Build the compact form of tree, such as one returned by buildHuffmanTree.
+ *
+ * Reports an error if the tree does not have at least two leaves.
+ */
+void compactTreeFrom(EncodingTreeNode* tree, CompactTree& compact) {
+    if (tree->isLeaf())
+        error("A compact tree needs at least two leaves.");
+    compact.nodeCount = 0;
+    compactSubtree(tree, compact);
+}
+
+/* Reads one subtree of the flattened form into compact, returning its child value.
+ */
+uint16_t unflattenCompactSubtree(BitReader& treeShape, const string& treeLeaves, int& leafIndex, CompactTree& compact) {
+    if (treeShape.readBit() == 0) {
+        if ((size_t) leafIndex >= treeLeaves.size())
+            error("Flattened tree has too few leaves.");
+        return COMPACT_LEAF | (uint8_t) treeLeaves[leafIndex++];
+    }
+    if (compact.nodeCount == 255)
+        error("Flattened tree has too many nodes.");
+    int index = compact.nodeCount++;
+    uint16_t zero = unflattenCompactSubtree(treeShape, treeLeaves, leafIndex, compact);
+    uint16_t one = unflattenCompactSubtree(treeShape, treeLeaves, leafIndex, compact);
+    compact.children[index][0] = zero;
+    compact.children[index][1] = one;
+    return index;
+}
+
+/**
+ * Reconstruct the compact form of the tree straight from the packed flattened form, with no
+ * node allocation, consuming the tree's bits from treeShape.
+ *
+ * Reports an error if the flattened tree does not have at least two leaves, or has more leaves
+ * than treeLeaves holds.
+ */
+void unflattenTree(BitBuffer& treeShape, const string& treeLeaves, CompactTree& compact) {
+    compact.nodeCount = 0;
+    BitReader reader(treeShape);
+    int leafIndex = 0;
+    uint16_t root = unflattenCompactSubtree(reader, treeLeaves, leafIndex, compact);
+    treeShape.seek(reader.position());
+    if (root & COMPACT_LEAF)
+        error("A compact tree needs at least two leaves.");
+}
+
+/* Records the code of every leaf below node in codes, code holding the path to node.
+ */
+void compactCodes(const CompactTree& tree, uint16_t node, uint64_t code, int length, SymbolCode codes[256]) {
+    if (node & COMPACT_LEAF) {
+        codes[node & 0xFF] = { code, length };
+    } else {
+        if (length >= 64)
+            error("Huffman code lengths above 64 bits are not supported.");
+        compactCodes(tree, tree.children[node][0], code << 1, length + 1, codes);
+        compactCodes(tree, tree.children[node][1], (code << 1) | 1, length + 1, codes);
+    }
+}
+
+/**
+ * Encode text with the compact tree, appending the bits to messageBits.
+ */
+void encodeText(const CompactTree& tree, string_view text, BitBuffer& messageBits) {
+    SymbolCode codes[256];
+    for (int symbol = 0; symbol < 256; symbol++) {
+        codes[symbol] = { 0, 0 };
+    }
+    compactCodes(tree, 0, 0, 0, codes);
+    encodeWithCodes(codes, reinterpret_cast<const uint8_t*>(text.data()), text.size(), messageBits);
+}
+
+/* The decode table entry for compact trees: like DecodeEntry, but the node to resume a long code
+ * from is a 16-bit index, which halves the entry to 8 bytes.
+ */
+struct CompactDecodeEntry {
+    uint8_t symbols[DECODE_MAX_SYMBOLS];
+    uint8_t symbolCount;
+    uint8_t bitCount;
+    uint16_t resume;
+};
+
+/* Builds the decode table for a compact tree, the same way as buildDecodeTable.
+ */
+vector<CompactDecodeEntry> buildDecodeTable(const CompactTree& tree) {
+    vector<CompactDecodeEntry> table(1 << DECODE_TABLE_BITS);
+    for (int window = 0; window < (1 << DECODE_TABLE_BITS); window++) {
+        CompactDecodeEntry& entry = table[window];
+        entry.symbolCount = 0;
+        entry.bitCount = 0;
+        uint16_t node = 0;
+        for (int i = 0; i < DECODE_TABLE_BITS; i++) {
+            node = tree.children[node][(window >> (DECODE_TABLE_BITS - 1 - i)) & 1];
+            if (node & COMPACT_LEAF) {
+                entry.symbols[entry.symbolCount++] = node & 0xFF;
+                entry.bitCount = i + 1;
+                node = 0;
+                if (entry.symbolCount == DECODE_MAX_SYMBOLS) break;
+            }
+        }
+        if (entry.symbolCount == 0) {
+            entry.bitCount = DECODE_TABLE_BITS;
+        }
+        entry.resume = node;
+    }
+    return table;
+}
+
+/**
+ * Decode the unread bits of messageBits with the compact tree, consuming them. Lookups go through
+ * the decode table, and codes longer than it are finished by walking the compact tree.
+ */
+string decodeText(const CompactTree& tree, BitBuffer& messageBits) {
+    vector<CompactDecodeEntry> table = buildDecodeTable(tree);
+    BitReader reader(messageBits);
+    string text = "";
+    uint16_t node = 0;
+    while (reader.remaining() >= DECODE_LOOKUPS_PER_REFILL * DECODE_TABLE_BITS) {
+        reader.refill();
+        for (int i = 0; i < DECODE_LOOKUPS_PER_REFILL; i++) {
+            const CompactDecodeEntry& entry = table[reader.peek(DECODE_TABLE_BITS)];
+            reader.consume(entry.bitCount);
+            if (entry.symbolCount == 0) {
+                node = entry.resume;
+                while (!(node & COMPACT_LEAF)) {
+                    if (reader.isEmpty())
+                        error("Compressed message bits are corrupt.");
+                    node = tree.children[node][reader.readBit()];
+                }
+                text += (char) (node & 0xFF);
+                break;
+            }
+            text.append(reinterpret_cast<const char*>(entry.symbols), entry.symbolCount);
+        }
+    }
+    node = 0;
+    while (!reader.isEmpty()) {
+        node = tree.children[node][reader.readBit()];
+        if (node & COMPACT_LEAF) {
+            text += (char) (node & 0xFF);
+            node = 0;
+        }
+    }
+    messageBits.seek(reader.position());
+    return text;
+}
+
+/* * * * * * Canonical Huffman Codes * * * * * */
+
+/* A Huffman-coded message whose header is just the code lengths. Since canonical codes are fully
+ * determined by each symbol's code length, the header lists the symbols in code order (shortest
+ * codes first, ties by byte value) and how many codes there are of each length, the same layout
+ * as a JPEG Huffman table.
+ */
+struct CanonicalEncodedData {
+    string symbols;
+    Vector<int> lengthCounts;  // lengthCounts[i] is the number of codes of length i; index 0 unused
+    int maxCodeLength = 0;     // code length limit the encoder used, or 0 if unlimited
+    BitBuffer messageBits;
+
+    uint64_t symbolCount = 0;  // length of the original text
+
+    // With more than one stream, the message is cut into streamCount equal segments (the last one
+    // possibly shorter) whose codes are stored one after another in messageBits, and
+    // streamStarts[i] is the bit offset where segment i begins.
+    int streamCount = 1;
+    Vector<uint64_t> streamStarts;
+};
+
+/* Most interleaved streams a message can be split into.
+ */
+const int MAX_STREAMS = 8;
+
+/* Longest code length limit that decompress decodes with a single table lookup per symbol. The
+ * table has 2^limit entries, so at 15 bits it is 64 KB.
+ */
+const int MAX_SINGLE_LOOKUP_BITS = 15;
+
+/* One item of a package-merge list: a leaf, or a package of two items from the previous list.
+ */
+struct PackageMergeItem {
+    uint64_t weight;
+    int leaf;     // index into the sorted leaves, or -1 for a package
+    int first;    // the package's two items in the previous list
+    int second;
+};
+
+/* Adds one to the code length of every leaf inside the given item of list level.
+ */
+void countPackageLeaves(const Vector<Vector<PackageMergeItem>>& lists, int level, int item, int leafLengths[]) {
+    const PackageMergeItem& current = lists[level][item];
+    if (current.leaf >= 0) {
+        leafLengths[current.leaf]++;
+    } else {
+        countPackageLeaves(lists, level - 1, current.first, leafLengths);
+        countPackageLeaves(lists, level - 1, current.second, leafLengths);
+    }
+}
+
+/* Computes optimal code lengths no longer than maxCodeLength with the package-merge algorithm.
+ * Each of maxCodeLength - 1 rounds pairs up neighbouring items of the previous list into packages
+ * and merges them with the leaves by weight. Every time a leaf appears among the first 2n - 2
+ * items of the final list, its code gets one bit longer.
+ *
+ * Reports an error if maxCodeLength bits cannot give every used symbol a distinct code.
+ */
+void limitedCodeLengths(const uint64_t counts[256], int maxCodeLength, int codeLengths[256]) {
+    Vector<int> leaves;
+    for (int symbol = 0; symbol < 256; symbol++) {
+        if (counts[symbol] > 0) leaves.add(symbol);
+    }
+    int leafCount = leaves.size();
+    if (leafCount <= 2) {
+        for (int symbol : leaves) codeLengths[symbol] = 1;
+        return;
+    }
+    if (maxCodeLength < 1 || maxCodeLength > 64 || (maxCodeLength < 9 && (1 << maxCodeLength) < leafCount))
+        error("Code length limit is too small for the number of distinct characters.");
+    stable_sort(leaves.begin(), leaves.end(), [&](int a, int b) {
+        return counts[a] < counts[b];
+    });
+    Vector<PackageMergeItem> leafItems;
+    for (int i = 0; i < leafCount; i++) {
+        leafItems.add({ counts[leaves[i]], i, -1, -1 });
+    }
+    Vector<Vector<PackageMergeItem>> lists;
+    lists.add(leafItems);
+    for (int level = 1; level < maxCodeLength; level++) {
+        const Vector<PackageMergeItem>& previous = lists[level - 1];
+        Vector<PackageMergeItem> merged;
+        int nextLeaf = 0;
+        int nextPackage = 0;
+        int packageCount = previous.size() / 2;
+        while (nextLeaf < leafCount || nextPackage < packageCount) {
+            uint64_t packageWeight = 0;
+            if (nextPackage < packageCount) {
+                packageWeight = previous[2 * nextPackage].weight + previous[2 * nextPackage + 1].weight;
+            }
+            if (nextPackage == packageCount || (nextLeaf < leafCount && leafItems[nextLeaf].weight <= packageWeight)) {
+                merged.add(leafItems[nextLeaf++]);
+            } else {
+                merged.add({ packageWeight, -1, 2 * nextPackage, 2 * nextPackage + 1 });
+                nextPackage++;
+            }
+        }
+        lists.add(merged);
+    }
+    int leafLengths[256] = { 0 };
+    for (int item = 0; item < 2 * leafCount - 2; item++) {
+        countPackageLeaves(lists, maxCodeLength - 1, item, leafLengths);
+    }
+    for (int i = 0; i < leafCount; i++) {
+        codeLengths[leaves[i]] = leafLengths[i];
+    }
+}
+
+/* Records the depth of each leaf of tree as its symbol's code length. A tree that is a single
+ * leaf gets a 1-bit code so it can still be written and read.
+ */
+void codeLengthsFromTree(EncodingTreeNode* tree, int depth, int codeLengths[256]) {
+    if (tree->isLeaf()) {
+        codeLengths[(uint8_t) tree->ch] = max(depth, 1);
+    } else {
+        codeLengthsFromTree(tree->zero, depth + 1, codeLengths);
+        codeLengthsFromTree(tree->one, depth + 1, codeLengths);
+    }
+}
+
+/* Fills in the symbols and lengthCounts header of data from per-symbol code lengths, where a
+ * length of 0 means the symbol is unused.
+ */
+void setCanonicalHeader(const int codeLengths[256], CanonicalEncodedData& data) {
+    int maxLength = 0;
+    for (int symbol = 0; symbol < 256; symbol++) {
+        maxLength = max(maxLength, codeLengths[symbol]);
+    }
+    if (maxLength > 64)
+        error("Huffman code lengths above 64 bits are not supported.");
+    data.symbols = "";
+    data.lengthCounts = Vector<int>(maxLength + 1, 0);
+    for (int length = 1; length <= maxLength; length++) {
+        for (int symbol = 0; symbol < 256; symbol++) {
+            if (codeLengths[symbol] == length) {
+                data.symbols += (char) symbol;
+                data.lengthCounts[length]++;
+            }
+        }
+    }
+}
+
+/* Assigns the canonical codes described by the header: codes of each length are consecutive
+ * integers in symbol order, and the first code of each length follows the last code of the
+ * previous length with a 0 appended. Unused symbols get length 0.
+ */
+void assignCanonicalCodes(const CanonicalEncodedData& data, SymbolCode codes[256]) {
+    for (int symbol = 0; symbol < 256; symbol++) {
+        codes[symbol] = { 0, 0 };
+    }
+    uint64_t code = 0;
+    int index = 0;
+    for (int length = 1; length < data.lengthCounts.size(); length++) {
+        for (int i = 0; i < data.lengthCounts[length]; i++) {
+            codes[(uint8_t) data.symbols[index++]] = { code++, length };
+        }
+        code <<= 1;
+    }
+}
+
+/* One entry of the canonical decode table, indexed by the next DECODE_TABLE_BITS bits. A length
+ * of 0 marks a window that only holds the start of a longer code.
+ */
+struct CanonicalDecodeEntry {
+    uint8_t symbol;
+    uint8_t length;
+};
+
+/* Builds a decode table of tableBits-bit windows straight from the header, with no tree: each code
+ * of length at most tableBits fills every window that starts with it.
+ */
+vector<CanonicalDecodeEntry> buildCanonicalDecodeTable(const CanonicalEncodedData& data, int tableBits) {
+    vector<CanonicalDecodeEntry> table(1 << tableBits, { 0, 0 });
+    uint64_t code = 0;
+    int index = 0;
+    for (int length = 1; length < data.lengthCounts.size(); length++) {
+        for (int i = 0; i < data.lengthCounts[length]; i++) {
+            uint8_t symbol = data.symbols[index++];
+            if (length <= tableBits) {
+                uint64_t first = code << (tableBits - length);
+                uint64_t last = (code + 1) << (tableBits - length);
+                for (uint64_t window = first; window < last; window++) {
+                    table[window] = { symbol, (uint8_t) length };
+                }
+            }
+            code++;
+        }
+        code <<= 1;
+    }
+    return table;
+}
+
+/* Decodes one symbol whose code is longer than the decode table, reading it a bit at a time.
+ * Within each length the canonical codes are consecutive, so the code read so far is checked
+ * against the range of that length before moving on to the next.
+ */
+uint8_t decodeLongCanonicalCode(const CanonicalEncodedData& data, const uint8_t* bytes, uint64_t& pos) {
+    uint64_t code = 0;
+    uint64_t first = 0;
+    int index = 0;
+    for (int length = 1; length < data.lengthCounts.size(); length++) {
+        code |= peekBitsAt(bytes, pos++, 1);
+        int count = data.lengthCounts[length];
+        if (code - first < (uint64_t) count) {
+            return data.symbols[index + (code - first)];
+        }
+        index += count;
+        first = (first + count) << 1;
+        code <<= 1;
+    }
+    error("Message bits do not match any code in the header.");
+}
+
+/* Reads one long code at the read cursor of messageBits, consuming it.
+ */
+uint8_t decodeLongCanonicalCode(const CanonicalEncodedData& data, BitBuffer& messageBits) {
+    uint64_t pos = messageBits.readPosition();
+    uint8_t symbol = decodeLongCanonicalCode(data, messageBits.bytes(), pos);
+    messageBits.skip(pos - messageBits.readPosition());
+    return symbol;
+}
+
+/* Computes the code length of each symbol from its count: Huffman's lengths by the two-queue
+ * method, or with package-merge if maxCodeLength is not 0. Symbols with no count get length 0.
+ */
+void canonicalCodeLengths(const uint64_t counts[256], int maxCodeLength, int codeLengths[256]) {
+    if (maxCodeLength == 0) {
+        HuffmanMerges merges;
+        mergeTwoQueues(counts, merges);
+        codeLengthsFromMerges(merges, codeLengths);
+    } else {
+        limitedCodeLengths(counts, maxCodeLength, codeLengths);
+    }
+}
+
+/* Returns the byte offset at which stream number stream of streamCount starts when length bytes
+ * are split into interleaved streams; stream streamCount starts at length.
+ */
+size_t streamSegmentStart(size_t length, int streamCount, int stream) {
+    size_t segmentLength = (length + streamCount - 1) / streamCount;
+    return min(length, stream * segmentLength);
+}
+
+/* Sets up data, which must be fresh, for length bytes with the given counts split into
+ * streamCount streams: the canonical header, the code length limit and the counts. The codes the
+ * header assigns are stored in codes, and the stream starts are left to the encoder.
+ */
+void prepareCanonical(const uint64_t counts[256], size_t length, int maxCodeLength, int streamCount,
+                      CanonicalEncodedData& data, SymbolCode codes[256]) {
+    if (streamCount < 1 || streamCount > MAX_STREAMS)
+        error("Stream count must be between 1 and " + integerToString(MAX_STREAMS) + ".");
+    int codeLengths[256] = { 0 };
+    canonicalCodeLengths(counts, maxCodeLength, codeLengths);
+    setCanonicalHeader(codeLengths, data);
+    data.maxCodeLength = maxCodeLength;
+    assignCanonicalCodes(data, codes);
+    data.streamCount = streamCount;
+    data.symbolCount = length;
+}
+
+/* Encodes length bytes with canonical codes into data, which must be fresh, split into
+ * streamCount interleaved streams. Unlike compressCanonical this accepts any non-empty input,
+ * giving a lone symbol a 1-bit code, so that it can encode arbitrary blocks of a stream.
+ */
+void encodeCanonical(const uint8_t* bytes, size_t length, int maxCodeLength, CanonicalEncodedData& data,
+                     int streamCount = 1) {
+    uint64_t counts[256] = { 0 };
+    countFrequencies(bytes, length, counts);
+    SymbolCode codes[256];
+    prepareCanonical(counts, length, maxCodeLength, streamCount, data, codes);
+    for (int stream = 0; stream < streamCount; stream++) {
+        size_t start = streamSegmentStart(length, streamCount, stream);
+        size_t end = streamSegmentStart(length, streamCount, stream + 1);
+        if (stream > 0) data.streamStarts.add(data.messageBits.size());
+        encodeWithCodes(codes, bytes + start, end - start, data.messageBits);
+    }
+}
+
+/**
+ * Compress the input text with canonical Huffman codes. Only the code lengths are kept as the
+ * header, in place of the flattened tree.
+ *
+ * If maxCodeLength is not 0, no code is longer than maxCodeLength bits. The lengths are then
+ * computed with package-merge instead of Huffman's algorithm, which gives the cheapest codes
+ * within the limit, and the limit is recorded in the header.
+ *
+ * A streamCount above 1 (up to MAX_STREAMS) splits the message into that many independently
+ * decodable streams, so the decoder can work on all of them at once; see decodeCanonicalInto.
+ *
+ * Reports an error if the message text does not contain at least
+ * two distinct characters, or if maxCodeLength is too small for its distinct characters.
+ */
+CanonicalEncodedData compressCanonical(string_view messageText, int maxCodeLength = 0, int streamCount = 1) {
+    if (messageText.size() < 2)
+        error("Input to be compressed shoudl contain at least two distinct characters to be Huffman-encodable.");
+    CanonicalEncodedData data;
+    encodeCanonical(reinterpret_cast<const uint8_t*>(messageText.data()), messageText.size(), maxCodeLength, data,
+                    streamCount);
+    return data;
+}
+
+/* Decodes the data.symbolCount symbols of data's streams into out, reading the message bits from
+ * the packed stream bytes with stream 0 starting at bit startPos. The bytes need not belong to
+ * data.messageBits, so this can decode straight out of a mapped file into a mapped file. Reports
+ * an error if any stream runs past bit endPos, which the bytes must extend at least 16 bytes past.
+ *
+ * A single stream is a chain of dependent lookups, since each code's position depends on the
+ * length of the one before; decoding one symbol from every stream per round gives the processor
+ * streamCount independent chains to overlap. Each stream's symbol count is known, so no stream
+ * needs a check for its end: a lookup that runs past a stream's last code still starts with that code.
+ */
+void decodeCanonicalInto(const CanonicalEncodedData& data, const uint8_t* bytes, uint64_t startPos,
+                         uint64_t endPos, char* out) {
+    bool singleLookup = data.maxCodeLength > 0 && data.maxCodeLength <= MAX_SINGLE_LOOKUP_BITS;
+    int tableBits = singleLookup ? data.maxCodeLength : DECODE_TABLE_BITS;
+    vector<CanonicalDecodeEntry> table = buildCanonicalDecodeTable(data, tableBits);
+    int streamCount = data.streamCount;
+    uint64_t segmentLength = (data.symbolCount + streamCount - 1) / streamCount;
+    uint64_t pos[MAX_STREAMS] = { 0 };
+    uint64_t next[MAX_STREAMS] = { 0 };
+    uint64_t end[MAX_STREAMS] = { 0 };
+    for (int stream = 0; stream < streamCount; stream++) {
+        pos[stream] = startPos + (stream == 0 ? 0 : data.streamStarts[stream - 1]);
+        next[stream] = min(data.symbolCount, stream * segmentLength);
+        end[stream] = min(data.symbolCount, next[stream] + segmentLength);
+    }
+    auto decodeOne = [&](int stream) {
+        if (pos[stream] > endPos)
+            error("Compressed message bits are corrupt.");
+        const CanonicalDecodeEntry& entry = table[peekBitsAt(bytes, pos[stream], tableBits)];
+        if (entry.length > 0) {
+            out[next[stream]++] = entry.symbol;
+            pos[stream] += entry.length;
+        } else {
+            out[next[stream]++] = decodeLongCanonicalCode(data, bytes, pos[stream]);
+        }
+    };
+    // The last stream is the shortest, so every stream has a symbol for each of its rounds
+    uint64_t rounds = end[streamCount - 1] - next[streamCount - 1];
+    for (uint64_t round = 0; round < rounds; round++) {
+        for (int stream = 0; stream < streamCount; stream++) {
+            decodeOne(stream);
+        }
+    }
+    for (int stream = 0; stream < streamCount; stream++) {
+        while (next[stream] < end[stream]) {
+            decodeOne(stream);
+        }
+    }
+}
+
+/**
+ * Decompress canonical Huffman data, consuming its message bits. The codes are rebuilt from the
+ * header's code lengths directly into a decode table without building a tree, and the text is
+ * allocated at its recorded length and decoded straight into it by decodeCanonicalInto.
+ *
+ * When the header records a code length limit of at most MAX_SINGLE_LOOKUP_BITS, the table is
+ * made that wide, so every symbol is exactly one lookup. Bits past the end of the message read as
+ * zeros, and the last code is still a prefix of its window, so even the tail needs no bit walk.
+ */
+string decompress(CanonicalEncodedData& data) {
+    BitBuffer& messageBits = data.messageBits;
+    string text(data.symbolCount, '\0');
+    decodeCanonicalInto(data, messageBits.bytes(), messageBits.readPosition(), messageBits.size(), &text[0]);
+    messageBits.skip(messageBits.remaining());
+    return text;
+}
+
+/* * * * * * Streaming Compression * * * * * */
+
+/* Bytes of input compressed at a time by compressStream. Memory use is a small multiple of this
+ * however long the stream is.
+ */
+const size_t STREAM_BLOCK_SIZE = 1 << 20;
+
+/* Identifies a stream written by compressStream, followed by a format version byte.
+ */
+const char STREAM_MAGIC[4] = { 'H', 'U', 'F', 'S' };
+
+/* Bytes of message bits read at a time by readCanonicalBits.
+ */
+const size_t STREAM_READ_CHUNK = 1 << 16;
+const int STREAM_VERSION = 3;
+
+/* Writes value to out as count big-endian bytes.
+ */
+void writeBigEndian(ostream& out, uint64_t value, int count) {
+    for (int i = count - 1; i >= 0; i--) {
+        out.put((char) ((value >> (8 * i)) & 0xFF));
+    }
+}
+
+/* Reads a count-byte big-endian value from in, reporting an error if the stream ends first.
+ */
+uint64_t readBigEndian(istream& in, int count) {
+    uint64_t value = 0;
+    for (int i = 0; i < count; i++) {
+        int byte = in.get();
+        if (byte == EOF)
+            error("Compressed stream ended unexpectedly.");
+        value = (value << 8) | byte;
+    }
+    return value;
+}
+
+/* Writes the code lengths of data: the code length limit, the longest code length, the number of
+ * codes of each length, then the symbols in code order.
+ */
+void writeCodeLengths(ostream& out, const CanonicalEncodedData& data) {
+    writeBigEndian(out, data.maxCodeLength, 1);
+    writeBigEndian(out, data.lengthCounts.size() - 1, 1);
+    for (int length = 1; length < data.lengthCounts.size(); length++) {
+        writeBigEndian(out, data.lengthCounts[length], 2);
+    }
+    out.write(data.symbols.data(), data.symbols.size());
+}
+
+/* Writes the canonical header of data: its code lengths as writeCodeLengths writes them, the
+ * symbol count, then the stream count, followed for more than one stream by the stream start
+ * offsets.
+ */
+void writeCanonicalHeader(ostream& out, const CanonicalEncodedData& data) {
+    writeCodeLengths(out, data);
+    writeBigEndian(out, data.symbolCount, 8);
+    writeBigEndian(out, data.streamCount, 1);
+    if (data.streamCount > 1) {
+        for (uint64_t start : data.streamStarts) {
+            writeBigEndian(out, start, 8);
+        }
+    }
+}
+
+/* Reads back code lengths written by writeCodeLengths, reporting an error if they are not a valid
+ * set of canonical code lengths.
+ */
+void readCodeLengths(istream& in, CanonicalEncodedData& data) {
+    data.maxCodeLength = readBigEndian(in, 1);
+    int maxLength = readBigEndian(in, 1);
+    if (maxLength > 63 || (data.maxCodeLength > 0 && maxLength > data.maxCodeLength))
+        error("Compressed stream has a corrupt code length header.");
+    data.lengthCounts = Vector<int>(maxLength + 1, 0);
+    int symbolCount = 0;
+    for (int length = 1; length <= maxLength; length++) {
+        data.lengthCounts[length] = readBigEndian(in, 2);
+        symbolCount += data.lengthCounts[length];
+    }
+    // Each length can use at most the codes the shorter lengths left free
+    uint64_t freeCodes = 1;
+    for (int length = 1; length <= maxLength; length++) {
+        freeCodes *= 2;
+        if ((uint64_t) data.lengthCounts[length] > freeCodes)
+            error("Compressed stream has a corrupt code length header.");
+        freeCodes -= data.lengthCounts[length];
+    }
+    if (symbolCount < 1 || symbolCount > 256)
+        error("Compressed stream has a corrupt code length header.");
+    data.symbols = string(symbolCount, '\0');
+    in.read(&data.symbols[0], symbolCount);
+}
+
+/* Reads back a header written by writeCanonicalHeader, reporting an error if its code lengths or
+ * stream count are not valid.
+ */
+void readCanonicalHeader(istream& in, CanonicalEncodedData& data) {
+    readCodeLengths(in, data);
+    data.symbolCount = readBigEndian(in, 8);
+    data.streamCount = readBigEndian(in, 1);
+    if (data.streamCount < 1 || data.streamCount > MAX_STREAMS)
+        error("Compressed stream has a corrupt stream count.");
+    data.streamStarts.clear();
+    if (data.streamCount > 1) {
+        for (int stream = 1; stream < data.streamCount; stream++) {
+            data.streamStarts.add(readBigEndian(in, 8));
+        }
+    }
+}
+
+/* Writes the canonical header and message bits of data: the header, then the number of message
+ * bits and the bits themselves, padded to a whole byte.
+ */
+void writeCanonicalData(ostream& out, const CanonicalEncodedData& data) {
+    writeCanonicalHeader(out, data);
+    writeBigEndian(out, data.messageBits.size(), 8);
+    out.write(reinterpret_cast<const char*>(data.messageBits.bytes()), (data.messageBits.size() + 7) / 8);
+}
+
+/* Reads bitCount message bits, padded to a whole byte, from in into messageBits. The bytes are
+ * read a chunk at a time, so a count that runs past the end of the stream fails once the input
+ * ends, without first allocating everything the count asks for.
+ */
+void readMessageBits(istream& in, uint64_t bitCount, BitBuffer& messageBits) {
+    uint64_t byteCount = (bitCount + 7) / 8;
+    vector<uint8_t> bytes;
+    while (bytes.size() < byteCount) {
+        size_t read = bytes.size();
+        size_t chunk = min<uint64_t>(byteCount - read, STREAM_READ_CHUNK);
+        bytes.resize(read + chunk);
+        in.read(reinterpret_cast<char*>(bytes.data()) + read, chunk);
+        if (!in)
+            error("Compressed stream ended unexpectedly.");
+    }
+    messageBits.assign(bytes.data(), bitCount);
+}
+
+/* Reads the number of message bits that follows a canonical header already read into data. The
+ * message can be no longer than symbolCount codes of the longest length in the header, nor than
+ * maxBits when the caller knows how much input there is, and no shorter than one bit per symbol,
+ * so any other bit count is reported as corrupt before anything is allocated for it.
+ */
+uint64_t readCanonicalBitCount(istream& in, const CanonicalEncodedData& data, uint64_t maxBits = ~(uint64_t) 0) {
+    uint64_t bitCount = readBigEndian(in, 8);
+    uint64_t longest = data.lengthCounts.size() - 1;
+    if (bitCount > maxBits || bitCount < data.symbolCount
+            || data.symbolCount < bitCount / longest + (bitCount % longest != 0))
+        error("Compressed stream has a corrupt bit count.");
+    for (uint64_t start : data.streamStarts) {
+        if (start > bitCount)
+            error("Compressed stream has a corrupt stream start.");
+    }
+    return bitCount;
+}
+
+/* Reads the message bits that follow a canonical header already read into data, with their count
+ * checked as readCanonicalBitCount describes.
+ */
+void readCanonicalBits(istream& in, CanonicalEncodedData& data, uint64_t maxBits = ~(uint64_t) 0) {
+    readMessageBits(in, readCanonicalBitCount(in, data, maxBits), data.messageBits);
+}
+
+/* Reads back data written by writeCanonicalData, with the message bounded as readCanonicalBits
+ * describes.
+ */
+void readCanonicalData(istream& in, CanonicalEncodedData& data, uint64_t maxBits = ~(uint64_t) 0) {
+    readCanonicalHeader(in, data);
+    readCanonicalBits(in, data, maxBits);
+}
+
+/**
+ * Compress everything readable from in to out, one block of blockSize bytes at a time. Each block
+ * gets its own canonical Huffman code, so only one block and its encoding are in memory at once
+ * and the stream can be any length.
+ *
+ * The output is STREAM_MAGIC and STREAM_VERSION, then for each block its length in bytes and its
+ * canonical data, then a block length of 0. Reports an error if blockSize is 0 or too large for
+ * the 4-byte block length.
+ */
+void compressStream(istream& in, ostream& out, size_t blockSize = STREAM_BLOCK_SIZE, int maxCodeLength = 0) {
+    if (blockSize == 0 || blockSize > 0xFFFFFFFF)
+        error("Stream block size is out of range.");
+    out.write(STREAM_MAGIC, sizeof(STREAM_MAGIC));
+    writeBigEndian(out, STREAM_VERSION, 1);
+    string block(blockSize, '\0');
+    while (in) {
+        in.read(&block[0], blockSize);
+        size_t length = in.gcount();
+        if (length == 0) break;
+        CanonicalEncodedData data;
+        encodeCanonical(reinterpret_cast<const uint8_t*>(block.data()), length, maxCodeLength, data);
+        writeBigEndian(out, length, 4);
+        writeCanonicalData(out, data);
+    }
+    writeBigEndian(out, 0, 4);
+}
+
+/**
+ * Decompress a stream written by compressStream from in to out, one block at a time.
+ *
+ * Reports an error if the input is not a compressed stream or ends early.
+ */
+void decompressStream(istream& in, ostream& out) {
+    char magic[sizeof(STREAM_MAGIC)];
+    in.read(magic, sizeof(magic));
+    if (!in || memcmp(magic, STREAM_MAGIC, sizeof(magic)) != 0 || readBigEndian(in, 1) != STREAM_VERSION)
+        error("Input is not a compressed stream.");
+    while (true) {
+        uint64_t length = readBigEndian(in, 4);
+        if (length == 0) break;
+        // The header's symbol count is checked against the block length before any bits are
+        // read, and the bits can then be no more than that many codes of the longest length
+        CanonicalEncodedData data;
+        readCanonicalHeader(in, data);
+        if (data.symbolCount != length)
+            error("Compressed block does not decode to its recorded length.");
+        readCanonicalBits(in, data);
+        string block = decompress(data);
+        out.write(block.data(), block.size());
+    }
+}
+
+/* * * * * * Block-Parallel Compression * * * * * */
+
+/* An istream buffer over bytes already in memory, so headers can be parsed out of a compressed
+ * string or a mapped file without copying it.
+ */
+class MemoryBuffer : public streambuf {
+public:
+    MemoryBuffer(const uint8_t* bytes, size_t length) {
+        char* begin = const_cast<char*>(reinterpret_cast<const char*>(bytes));
+        setg(begin, begin, begin + length);
+    }
+
+    /* The number of bytes read so far. */
+    size_t position() const {
+        return gptr() - eback();
+    }
+
+    /* Moves past count more bytes, which must not run past the end. */
+    void skip(size_t count) {
+        setg(eback(), gptr() + count, egptr());
+    }
+};
+
+/* Identifies data written by compressParallel, followed by a format version byte.
+ */
+const char PARALLEL_MAGIC[4] = { 'H', 'U', 'F', 'P' };
+const int PARALLEL_VERSION = 3;
+
+/* Runs task(i) for every i from 0 to taskCount - 1 on threadCount threads, each thread taking the
+ * next unclaimed index until none are left. An error raised by any task is reported on the calling
+ * thread once all threads have finished.
+ */
+void runInParallel(int taskCount, int threadCount, function<void(int)> task) {
+    atomic<int> nextTask(0);
+    exception_ptr failure = nullptr;
+    mutex failureLock;
+    auto worker = [&]() {
+        for (int i = nextTask++; i < taskCount; i = nextTask++) {
+            try {
+                task(i);
+            } catch (...) {
+                lock_guard<mutex> guard(failureLock);
+                if (!failure) failure = current_exception();
+            }
+        }
+    };
+    vector<thread> threads;
+    for (int i = 1; i < min(threadCount, taskCount); i++) {
+        threads.push_back(thread(worker));
+    }
+    worker();
+    for (thread& t : threads) {
+        t.join();
+    }
+    if (failure) rethrow_exception(failure);
+}
+
+/**
+ * Compress text as independent blocks of blockSize bytes, each with its own canonical code,
+ * encoding the blocks on threadCount threads. With one thread and a block at least as large as
+ * the text this is a single canonical block.
+ *
+ * The result is PARALLEL_MAGIC and PARALLEL_VERSION, the block count, an index holding each
+ * block's raw length and compressed length, then the blocks as written by writeCanonicalData. The
+ * index lets decompressParallel find every block without decoding the ones before it.
+ *
+ * Reports an error if blockSize is 0 or leaves more blocks than an int can count.
+ */
+string compressParallel(string_view text, int threadCount, size_t blockSize = STREAM_BLOCK_SIZE, int maxCodeLength = 0) {
+    if (blockSize == 0)
+        error("Block size must be positive.");
+    size_t count = text.size() / blockSize + (text.size() % blockSize != 0);
+    if (count > 0x7FFFFFFF)
+        error("Block size leaves too many blocks.");
+    int blockCount = count;
+    vector<string> blocks(blockCount);
+    runInParallel(blockCount, threadCount, [&](int i) {
+        size_t offset = i * blockSize;
+        size_t length = min(blockSize, text.size() - offset);
+        CanonicalEncodedData data;
+        encodeCanonical(reinterpret_cast<const uint8_t*>(text.data()) + offset, length, maxCodeLength, data);
+        ostringstream out;
+        writeCanonicalData(out, data);
+        blocks[i] = out.str();
+    });
+    ostringstream out;
+    out.write(PARALLEL_MAGIC, sizeof(PARALLEL_MAGIC));
+    writeBigEndian(out, PARALLEL_VERSION, 1);
+    writeBigEndian(out, blockCount, 4);
+    for (int i = 0; i < blockCount; i++) {
+        writeBigEndian(out, min(blockSize, text.size() - i * blockSize), 8);
+        writeBigEndian(out, blocks[i].size(), 8);
+    }
+    for (const string& block : blocks) {
+        out.write(block.data(), block.size());
+    }
+    return out.str();
+}
+
+/**
+ * Decompress data written by compressParallel, decoding the blocks on threadCount threads
+ * straight from the input into their place in the output, which is allocated once at its full
+ * length. Headers and message bits are read in place, so no block is copied out of the input.
+ *
+ * Reports an error if the input was not written by compressParallel or is truncated or corrupt.
+ * The index is checked before anything is allocated: it must fit in the input, and each block
+ * can hold at most 8 symbols per byte, since every code is at least one bit. Likewise a block's
+ * message bits must fit in its indexed length.
+ */
+string decompressParallel(string_view compressed, int threadCount) {
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(compressed.data());
+    MemoryBuffer buffer(bytes, compressed.size());
+    istream in(&buffer);
+    char magic[sizeof(PARALLEL_MAGIC)];
+    in.read(magic, sizeof(magic));
+    if (!in || memcmp(magic, PARALLEL_MAGIC, sizeof(magic)) != 0 || readBigEndian(in, 1) != PARALLEL_VERSION)
+        error("Input is not block-parallel compressed data.");
+    uint64_t blockCount = readBigEndian(in, 4);
+    const uint64_t indexStart = 4 + 1 + 4;
+    if (blockCount > (compressed.size() - indexStart) / 16)
+        error("Block-parallel compressed data is truncated.");
+    vector<uint64_t> rawOffsets(blockCount + 1, 0);
+    vector<uint64_t> blockOffsets(blockCount + 1, 0);
+    blockOffsets[0] = indexStart + 16 * blockCount;
+    for (uint64_t i = 0; i < blockCount; i++) {
+        uint64_t rawLength = readBigEndian(in, 8);
+        uint64_t blockLength = readBigEndian(in, 8);
+        if (blockLength > compressed.size() - blockOffsets[i])
+            error("Block-parallel compressed data is truncated.");
+        if (rawLength > 8 * blockLength)
+            error("Block-parallel compressed data has a corrupt block length.");
+        rawOffsets[i + 1] = rawOffsets[i] + rawLength;
+        blockOffsets[i + 1] = blockOffsets[i] + blockLength;
+    }
+    string text(rawOffsets[blockCount], '\0');
+    runInParallel(blockCount, threadCount, [&](int i) {
+        uint64_t blockLength = blockOffsets[i + 1] - blockOffsets[i];
+        MemoryBuffer blockBuffer(bytes + blockOffsets[i], blockLength);
+        istream blockIn(&blockBuffer);
+        CanonicalEncodedData data;
+        readCanonicalHeader(blockIn, data);
+        uint64_t bitCount = readCanonicalBitCount(blockIn, data, 8 * blockLength);
+        if (data.symbolCount != rawOffsets[i + 1] - rawOffsets[i])
+            error("Compressed block does not decode to its recorded length.");
+        uint64_t messageStart = blockOffsets[i] + blockBuffer.position();
+        uint64_t messageLength = (bitCount + 7) / 8;
+        if (messageLength > blockOffsets[i + 1] - messageStart)
+            error("Block-parallel compressed data is truncated.");
+        // The decoder loads whole words up to 16 bytes past the message, which the blocks after
+        // it cover everywhere but at the very end of the input; only there is the message copied
+        if (messageStart + messageLength + 16 <= compressed.size()) {
+            decodeCanonicalInto(data, bytes, 8 * messageStart, 8 * messageStart + bitCount, &text[rawOffsets[i]]);
+        } else {
+            data.messageBits.assign(bytes + messageStart, bitCount);
+            decodeCanonicalInto(data, data.messageBits.bytes(), 0, bitCount, &text[rawOffsets[i]]);
+        }
+    });
+    return text;
+}
+
+/* * * * * * Compressed Files * * * * * */
+
+/* Identifies a file written by compressFile, followed by a format version byte and the kind of
+ * code it holds.
+ */
+const char FILE_MAGIC[4] = { 'H', 'U', 'F', 'F' };
+const int FILE_VERSION = 2;
+const int FILE_KIND_CANONICAL = 0;
+const int FILE_KIND_TREE = 1;
+
+/* Zero bytes after the message bits of a compressed file, so the decoder can load whole words at
+ * its last few bit positions without reading past the mapping.
+ */
+const int FILE_PADDING = 16;
+
+/* Returns the CRC-32 (the IEEE polynomial used by zip and PNG) of the length bytes at bytes,
+ * continuing from the crc of any bytes before them.
+ */
+uint32_t crc32(const uint8_t* bytes, size_t length, uint32_t crc = 0) {
+    static uint32_t table[256];
+    static once_flag tableBuilt;
+    call_once(tableBuilt, []() {
+        for (uint32_t byte = 0; byte < 256; byte++) {
+            uint32_t value = byte;
+            for (int bit = 0; bit < 8; bit++) {
+                value = (value >> 1) ^ (value & 1 ? 0xEDB88320 : 0);
+            }
+            table[byte] = value;
+        }
+    });
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++) {
+        crc = table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+/* A whole file mapped into memory, either read-only or created at a given size for writing. The
+ * mapping is released, and a written file completed, when the MappedFile is destroyed. Where
+ * mmap is unavailable the file is read into or written from an ordinary buffer instead.
+ */
+class MappedFile {
+public:
+    /* Maps the existing file at path for reading, reporting an error if it cannot be opened. */
+    explicit MappedFile(const string& path) : path(path), writable(false) {
+#ifdef _WIN32
+        ifstream in(path, ios::binary);
+        if (!in)
+            error("Cannot open " + path + " for reading.");
+        buffer.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+        start = buffer.data();
+        length = buffer.size();
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            error("Cannot open " + path + " for reading.");
+        struct stat info;
+        if (fstat(fd, &info) != 0) {
+            close(fd);
+            error("Cannot read the size of " + path + ".");
+        }
+        map(fd, info.st_size, PROT_READ, MAP_PRIVATE);
+#endif
+    }
+
+    /* Creates the file at path, replacing any file already there, and maps size bytes of it for
+     * writing. Reports an error if it cannot be created.
+     */
+    MappedFile(const string& path, size_t size) : path(path), writable(true) {
+#ifdef _WIN32
+        buffer.assign(size, 0);
+        start = buffer.data();
+        length = size;
+#else
+        int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            error("Cannot open " + path + " for writing.");
+        if (ftruncate(fd, size) != 0) {
+            close(fd);
+            error("Cannot resize " + path + ".");
+        }
+        map(fd, size, PROT_READ | PROT_WRITE, MAP_SHARED);
+#endif
+    }
+
+    ~MappedFile() {
+#ifdef _WIN32
+        if (writable) {
+            ofstream out(path, ios::binary | ios::trunc);
+            out.write(reinterpret_cast<const char*>(start), length);
+        }
+#else
+        if (length > 0) munmap(start, length);
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    uint8_t* data() {
+        return start;
+    }
+
+    const uint8_t* data() const {
+        return start;
+    }
+
+    size_t size() const {
+        return length;
+    }
+
+private:
+#ifndef _WIN32
+    // An empty file cannot be mapped, so it is left as a null range
+    void map(int fd, size_t size, int protection, int flags) {
+        start = nullptr;
+        length = size;
+        if (size > 0) {
+            void* mapping = mmap(nullptr, size, protection, flags, fd, 0);
+            if (mapping == MAP_FAILED) {
+                close(fd);
+                error("Cannot map " + path + " into memory.");
+            }
+            start = static_cast<uint8_t*>(mapping);
+        }
+        close(fd);
+    }
+#endif
+
+    string path;
+    bool writable;
+    uint8_t* start = nullptr;
+    size_t length = 0;
+#ifdef _WIN32
+    vector<uint8_t> buffer;
+#endif
+};
+
+/* Returns the wall time in seconds that operation takes to run.
+ */
+double secondsFor(function<void()> operation) {
+    auto start = chrono::steady_clock::now();
+    operation();
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+/* The time one phase of compressing or decompressing took.
+ */
+struct PhaseTime {
+    string phase;
+    double seconds;
+};
+
+/* Records how long each phase of an operation takes into a list, each phase ending where the
+ * next begins. Given no list it records nothing and never reads the clock, so compressFile and
+ * decompressFile only pay for timing when a caller asks for it.
+ */
+class PhaseClock {
+public:
+    explicit PhaseClock(Vector<PhaseTime>* phases) : phases(phases) {
+        if (phases != nullptr) start = chrono::steady_clock::now();
+    }
+
+    /* Records the time since the previous phase ended, or since construction, as phase. */
+    void endPhase(const string& phase) {
+        if (phases == nullptr) return;
+        auto now = chrono::steady_clock::now();
+        chrono::duration<double> elapsed = now - start;
+        phases->add({ phase, elapsed.count() });
+        start = now;
+    }
+
+private:
+    Vector<PhaseTime>* phases;
+    chrono::steady_clock::time_point start;
+};
+
+/* Writes the bitCount bits of bits to out as the bit count and the bytes holding them.
+ */
+void writeFileBits(ostream& out, const BitBuffer& bits) {
+    writeBigEndian(out, bits.size(), 8);
+    out.write(reinterpret_cast<const char*>(bits.bytes()), (bits.size() + 7) / 8);
+}
+
+/* Reads the bit count written by writeFileBits and skips over the bytes holding the bits,
+ * reporting an error if they would run past byte end of the file. Returns the bit count.
+ */
+uint64_t skipFileBits(istream& in, MemoryBuffer& buffer, size_t end) {
+    uint64_t bitCount = readBigEndian(in, 8);
+    uint64_t byteCount = bitCount / 8 + (bitCount % 8 != 0);
+    if (buffer.position() > end || byteCount > end - buffer.position())
+        error("Compressed file is truncated.");
+    buffer.skip(byteCount);
+    return bitCount;
+}
+
+/* Suffix of the temporary file compressFile and decompressFile write before it replaces their
+ * output.
+ */
+const string FILE_PARTIAL_SUFFIX = ".part";
+
+/**
+ * Compress the file at inPath into a new file at outPath, replacing anything already there.
+ *
+ * The output holds FILE_MAGIC, FILE_VERSION, the kind of code, the original length and its CRC-32,
+ * then the code and the message bits: for FILE_KIND_CANONICAL the canonical header (with the given
+ * maxCodeLength and streamCount) as written by writeCanonicalHeader, and for FILE_KIND_TREE the
+ * flattened tree shape and leaves. The input is read through a mapping. The code is built from
+ * its histogram, which also gives the exact size of the message, so the output is mapped at its
+ * final size and the message is encoded straight into it. Only the header, a few hundred bytes at
+ * most, is built separately and copied in. The output is written to a temporary file next to
+ * outPath and renamed over it once complete, so outPath may be inPath itself.
+ *
+ * If phases is not null, the time of each phase is added to it: the checksum (the first pass
+ * over the input, which also pays for mapping it in), the histogram, building the code and
+ * header, and encoding into the output.
+ *
+ * Any input, even an empty one, can be compressed as either kind. Reports an error if a file
+ * cannot be opened.
+ */
+void compressFile(const string& inPath, const string& outPath, int kind = FILE_KIND_CANONICAL,
+                  int maxCodeLength = 0, int streamCount = 1, Vector<PhaseTime>* phases = nullptr) {
+    if (kind != FILE_KIND_CANONICAL && kind != FILE_KIND_TREE)
+        error("Unknown compressed file kind.");
+    PhaseClock clock(phases);
+    MappedFile input(inPath);
+    const uint8_t* bytes = input.data();
+    size_t length = input.size();
+    ostringstream header;
+    header.write(FILE_MAGIC, sizeof(FILE_MAGIC));
+    writeBigEndian(header, FILE_VERSION, 1);
+    writeBigEndian(header, kind, 1);
+    writeBigEndian(header, length, 8);
+    writeBigEndian(header, crc32(bytes, length), 4);
+    clock.endPhase("checksum");
+    uint64_t counts[256] = { 0 };
+    countFrequencies(bytes, length, counts);
+    clock.endPhase("histogram");
+    SymbolCode codes[256] = {};
+    CanonicalEncodedData canonical;
+    size_t canonicalAt = header.tellp();
+    if (length > 0 && kind == FILE_KIND_CANONICAL) {
+        prepareCanonical(counts, length, maxCodeLength, streamCount, canonical, codes);
+        // The stream starts are only known once the streams are encoded, so the header is
+        // written with placeholders of the same size and written again afterwards
+        canonical.streamStarts = Vector<uint64_t>(streamCount - 1, 0);
+        writeCanonicalHeader(header, canonical);
+    } else if (length > 0) {
+        // Like encodeCanonical, give a lone byte a 1-bit code, by pairing it with an unused byte
+        // in the tree, so that every input has a tree with at least two leaves
+        uint64_t treeCounts[256];
+        copy(counts, counts + 256, treeCounts);
+        if (treeCounts[bytes[0]] == length) {
+            treeCounts[(bytes[0] + 1) % 256] = 1;
+        }
+        TreeArena arena;
+        EncodingTreeNode* tree = buildHuffmanTreeFromCounts(treeCounts, &arena);
+        BitBuffer treeShape;
+        string treeLeaves;
+        flattenTree(tree, treeShape, treeLeaves);
+        buildCodeTable(tree, codes);
+        writeFileBits(header, treeShape);
+        writeBigEndian(header, treeLeaves.size(), 2);
+        header.write(treeLeaves.data(), treeLeaves.size());
+    }
+    uint64_t bitCount = encodedBits(counts, codes);
+    writeBigEndian(header, bitCount, 8);
+    string headerBytes = header.str();
+    size_t messageLength = (bitCount + 7) / 8;
+    clock.endPhase("code build");
+
+    // Truncating outPath while input still maps it would fault, if the two are the same file
+    string partialPath = outPath + FILE_PARTIAL_SUFFIX;
+    try {
+        {
+            // A newly created file reads as zeros, as encodeWithCodes needs past its starting position
+            MappedFile output(partialPath, headerBytes.size() + messageLength + FILE_PADDING);
+            uint8_t* message = output.data() + headerBytes.size();
+            uint64_t pos = 0;
+            if (length > 0 && kind == FILE_KIND_CANONICAL) {
+                for (int stream = 0; stream < streamCount; stream++) {
+                    size_t start = streamSegmentStart(length, streamCount, stream);
+                    size_t end = streamSegmentStart(length, streamCount, stream + 1);
+                    if (stream > 0) canonical.streamStarts[stream - 1] = pos;
+                    pos = encodeWithCodes(codes, bytes + start, end - start, message, pos);
+                }
+                ostringstream canonicalHeader;
+                writeCanonicalHeader(canonicalHeader, canonical);
+                headerBytes.replace(canonicalAt, canonicalHeader.str().size(), canonicalHeader.str());
+            } else if (length > 0) {
+                pos = encodeWithCodes(codes, bytes, length, message, 0);
+            }
+            if (pos != bitCount)
+                error("Encoded message does not match its computed size.");
+            memcpy(output.data(), headerBytes.data(), headerBytes.size());
+            clock.endPhase("encode");
+        }
+#ifdef _WIN32
+        remove(outPath.c_str());
+#endif
+        if (rename(partialPath.c_str(), outPath.c_str()) != 0)
+            error("Cannot replace " + outPath + ".");
+    } catch (...) {
+        remove(partialPath.c_str());
+        throw;
+    }
+}
+
+/* Returns whether treeShape holds exactly the flattened shape of one tree with leafCount leaves
+ * and at most 255 parents. The shape is walked without recursion, counting the subtrees still to
+ * be read, so a forged shape is caught before unflattenTree rebuilds it.
+ */
+bool isFlattenedShape(const BitBuffer& treeShape, int leafCount) {
+    BitReader reader(treeShape);
+    int pending = 1;
+    int parents = 0;
+    int leaves = 0;
+    while (pending > 0 && !reader.isEmpty()) {
+        if (reader.readBit() == 1) {
+            if (++parents > 255) return false;
+            pending++;
+        } else {
+            leaves++;
+            pending--;
+        }
+    }
+    return pending == 0 && reader.isEmpty() && leaves == leafCount;
+}
+
+/**
+ * Decompress a file written by compressFile at inPath into a new file at outPath, replacing
+ * anything already there. The message bits are decoded straight from the input mapping into a
+ * mapping of a temporary file next to outPath, which replaces outPath only once the text matches
+ * its checksum, so a corrupt input never touches an existing file. Only a tree file's shape and
+ * leaves, at most a few hundred bytes, are copied out to rebuild the tree.
+ *
+ * If phases is not null, the time of each phase is added to it: reading and checking the
+ * header, decoding into the output, and checking the text against its checksum.
+ *
+ * Reports an error if the input is not a compressed file, is truncated or corrupt, or does not
+ * match its checksum once decoded.
+ */
+void decompressFile(const string& inPath, const string& outPath, Vector<PhaseTime>* phases = nullptr) {
+    PhaseClock clock(phases);
+    MappedFile input(inPath);
+    MemoryBuffer buffer(input.data(), input.size());
+    istream in(&buffer);
+    char magic[sizeof(FILE_MAGIC)];
+    in.read(magic, sizeof(magic));
+    if (!in || memcmp(magic, FILE_MAGIC, sizeof(magic)) != 0 || readBigEndian(in, 1) != FILE_VERSION)
+        error("Input is not a compressed file.");
+    int kind = readBigEndian(in, 1);
+    uint64_t originalLength = readBigEndian(in, 8);
+    uint32_t checksum = readBigEndian(in, 4);
+    if (kind != FILE_KIND_CANONICAL && kind != FILE_KIND_TREE)
+        error("Compressed file has an unknown kind.");
+    if (input.size() < FILE_PADDING)
+        error("Compressed file is truncated.");
+    size_t end = input.size() - FILE_PADDING;
+
+    // Read the whole header before creating any output
+    CanonicalEncodedData canonical;
+    PackedEncodedData tree;
+    uint64_t startPos = 0;
+    uint64_t bitCount = 0;
+    if (originalLength > 0 && kind == FILE_KIND_CANONICAL) {
+        readCanonicalHeader(in, canonical);
+        if (canonical.symbolCount != originalLength)
+            error("Compressed file has a corrupt header.");
+        startPos = (buffer.position() + 8) * 8;
+        bitCount = skipFileBits(in, buffer, end);
+        for (uint64_t start : canonical.streamStarts) {
+            if (start > bitCount)
+                error("Compressed file has a corrupt stream start.");
+        }
+    } else if (originalLength > 0) {
+        size_t shapeStart = buffer.position() + 8;
+        uint64_t shapeBits = skipFileBits(in, buffer, end);
+        tree.treeShape.assign(input.data() + shapeStart, shapeBits);
+        int leafCount = readBigEndian(in, 2);
+        if (leafCount < 2 || leafCount > 256 || buffer.position() > end || (size_t) leafCount > end - buffer.position())
+            error("Compressed file has a corrupt tree.");
+        if (!isFlattenedShape(tree.treeShape, leafCount))
+            error("Compressed file has a corrupt tree.");
+        tree.treeLeaves = string(reinterpret_cast<const char*>(input.data()) + buffer.position(), leafCount);
+        buffer.skip(leafCount);
+        startPos = (buffer.position() + 8) * 8;
+        bitCount = skipFileBits(in, buffer, end);
+    }
+    // Every code is at least one bit, so the text is at most one byte per message bit, and the
+    // message bits fit in the file. A longer recorded length is forged.
+    if (originalLength > bitCount)
+        error("Compressed file has a corrupt length.");
+    clock.endPhase("header");
+
+    string partialPath = outPath + FILE_PARTIAL_SUFFIX;
+    try {
+        {
+            MappedFile output(partialPath, originalLength);
+            char* text = reinterpret_cast<char*>(output.data());
+            if (originalLength > 0 && kind == FILE_KIND_CANONICAL) {
+                decodeCanonicalInto(canonical, input.data(), startPos, startPos + bitCount, text);
+            } else if (originalLength > 0) {
+                TreeArena arena;
+                EncodingTreeNode* root = unflattenTree(tree.treeShape, tree.treeLeaves, arena);
+                vector<DecodeEntry> table = buildDecodeTable(root);
+                BitReader reader(input.data(), startPos + bitCount, startPos);
+                if (decodeWithTable(root, table, reader, text, originalLength) != originalLength || !reader.isEmpty())
+                    error("Compressed file does not decode to its recorded length.");
+            }
+            clock.endPhase("decode");
+            if (crc32(output.data(), originalLength) != checksum)
+                error("Compressed file does not match its checksum.");
+            clock.endPhase("checksum");
+        }
+#ifdef _WIN32
+        remove(outPath.c_str());
+#endif
+        if (rename(partialPath.c_str(), outPath.c_str()) != 0)
+            error("Cannot replace " + outPath + ".");
+    } catch (...) {
+        remove(partialPath.c_str());
+        throw;
+    }
+}
+
+/* * * * * * Block Splitting * * * * * */
+
+/* Identifies data written by compressSplit, followed by a format version byte.
+ */
+const char SPLIT_MAGIC[4] = { 'H', 'U', 'F', 'B' };
+const int SPLIT_VERSION = 2;
+
+/* Bytes per block of compressSplit. Small enough to follow drifting statistics, large enough
+ * that a fresh table's header stays a small part of a block.
+ */
+const size_t SPLIT_BLOCK_SIZE = 1 << 14;
+
+/* Block flags of compressSplit: the block brings a fresh table, or reuses the previous block's.
+ */
+const int SPLIT_FRESH_TABLE = 1;
+const int SPLIT_REUSE_TABLE = 0;
+
+/* Returns the bits needed to code a block with the given symbol counts under codeLengths, or
+ * UINT64_MAX if some symbol of the block has no code.
+ */
+uint64_t codedBits(const uint64_t counts[256], const int codeLengths[256]) {
+    uint64_t bits = 0;
+    for (int symbol = 0; symbol < 256; symbol++) {
+        if (counts[symbol] > 0 && codeLengths[symbol] == 0) return UINT64_MAX;
+        bits += counts[symbol] * codeLengths[symbol];
+    }
+    return bits;
+}
+
+/* Returns the bits writeCodeLengths takes for codeLengths: two length bytes, a 2-byte count for
+ * each code length, and a byte for each symbol.
+ */
+uint64_t headerBits(const int codeLengths[256]) {
+    int maxLength = 0;
+    int symbolCount = 0;
+    for (int symbol = 0; symbol < 256; symbol++) {
+        maxLength = max(maxLength, codeLengths[symbol]);
+        if (codeLengths[symbol] > 0) symbolCount++;
+    }
+    return 8 * (2 + 2 * maxLength + symbolCount);
+}
+
+/**
+ * Compress text as blocks of blockSize bytes, where each block either brings a fresh canonical
+ * table built from its own counts or reuses the table of the block before, as DEFLATE's dynamic
+ * blocks do. Data whose statistics drift gets codes that follow it, while steady data pays for
+ * one header.
+ *
+ * The choice is made from the block's histogram alone: the fresh table's code lengths come
+ * straight from the counts, so both costs, header included, are sums of count times length, and
+ * no block is encoded twice. A table is reused whenever that costs no more bits.
+ *
+ * The result is SPLIT_MAGIC and SPLIT_VERSION, the total length, then for each block its length,
+ * its flag, the fresh table's code lengths if it has one, and its message bits. A block is always
+ * one stream and its length gives its symbol count, so the table carries neither. Reports an
+ * error if blockSize is 0 or too large for the 4-byte block length.
+ */
+string compressSplit(string_view text, size_t blockSize = SPLIT_BLOCK_SIZE, int maxCodeLength = 0) {
+    if (blockSize == 0 || blockSize > 0xFFFFFFFF)
+        error("Split block size is out of range.");
+    ostringstream out;
+    out.write(SPLIT_MAGIC, sizeof(SPLIT_MAGIC));
+    writeBigEndian(out, SPLIT_VERSION, 1);
+    writeBigEndian(out, text.size(), 8);
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(text.data());
+    int tableLengths[256] = { 0 };
+    CanonicalEncodedData table;
+    SymbolCode codes[256];
+    bool haveTable = false;
+    for (size_t offset = 0; offset < text.size(); offset += blockSize) {
+        size_t length = min(blockSize, text.size() - offset);
+        uint64_t counts[256] = { 0 };
+        countFrequencies(bytes + offset, length, counts);
+        int freshLengths[256] = { 0 };
+        canonicalCodeLengths(counts, maxCodeLength, freshLengths);
+        uint64_t freshCost = headerBits(freshLengths) + codedBits(counts, freshLengths);
+        bool reuse = haveTable && codedBits(counts, tableLengths) <= freshCost;
+        writeBigEndian(out, length, 4);
+        writeBigEndian(out, reuse ? SPLIT_REUSE_TABLE : SPLIT_FRESH_TABLE, 1);
+        if (!reuse) {
+            copy(freshLengths, freshLengths + 256, tableLengths);
+            table = CanonicalEncodedData();
+            setCanonicalHeader(tableLengths, table);
+            table.maxCodeLength = maxCodeLength;
+            assignCanonicalCodes(table, codes);
+            writeCodeLengths(out, table);
+            haveTable = true;
+        }
+        BitBuffer messageBits;
+        encodeWithCodes(codes, bytes + offset, length, messageBits);
+        writeBigEndian(out, messageBits.size(), 8);
+        out.write(reinterpret_cast<const char*>(messageBits.bytes()), (messageBits.size() + 7) / 8);
+    }
+    return out.str();
+}
+
+/**
+ * Decompress data written by compressSplit into a text allocated once at its recorded length.
+ *
+ * Reports an error if the input was not written by compressSplit or is truncated or corrupt.
+ */
+string decompressSplit(string_view compressed) {
+    MemoryBuffer buffer(reinterpret_cast<const uint8_t*>(compressed.data()), compressed.size());
+    istream in(&buffer);
+    char magic[sizeof(SPLIT_MAGIC)];
+    in.read(magic, sizeof(magic));
+    if (!in || memcmp(magic, SPLIT_MAGIC, sizeof(magic)) != 0 || readBigEndian(in, 1) != SPLIT_VERSION)
+        error("Input is not block-split compressed data.");
+    uint64_t totalLength = readBigEndian(in, 8);
+    // Every symbol takes at least a bit, which bounds the length before anything is allocated
+    if (totalLength / 8 > compressed.size())
+        error("Block-split compressed data has a corrupt length.");
+    string text(totalLength, '\0');
+    CanonicalEncodedData table;
+    bool haveTable = false;
+    for (uint64_t offset = 0; offset < totalLength; ) {
+        uint64_t length = readBigEndian(in, 4);
+        int flag = readBigEndian(in, 1);
+        if (flag == SPLIT_FRESH_TABLE) {
+            readCodeLengths(in, table);
+            haveTable = true;
+        } else if (flag != SPLIT_REUSE_TABLE || !haveTable) {
+            error("Block-split compressed data has a corrupt block.");
+        }
+        if (length == 0 || length > totalLength - offset)
+            error("Block-split compressed data has a corrupt block length.");
+        uint64_t bitCount = readBigEndian(in, 8);
+        uint64_t byteCount = bitCount / 8 + (bitCount % 8 != 0);
+        if (byteCount > compressed.size() - buffer.position())
+            error("Block-split compressed data is truncated.");
+        BitBuffer messageBits;
+        messageBits.assign(reinterpret_cast<const uint8_t*>(compressed.data()) + buffer.position(), bitCount);
+        buffer.skip(byteCount);
+        table.symbolCount = length;
+        table.streamCount = 1;
+        table.streamStarts.clear();
+        decodeCanonicalInto(table, messageBits.bytes(), 0, bitCount, &text[offset]);
+        offset += length;
+    }
+    return text;
+}
+
+/* * * * * * Shared Huffman Tables * * * * * */
+
+/* Identifies a table written by writeTable, followed by a format version byte.
+ */
+const char TABLE_MAGIC[4] = { 'H', 'U', 'F', 'T' };
+const int TABLE_VERSION = 1;
+
+/* Default code length limit of a trained table. Every byte value needs a code, so the limit is
+ * at least 8; at 12 the decode table is 8 KB and every symbol is one lookup.
+ */
+const int TABLE_CODE_LENGTH = 12;
+
+/* A canonical code trained once on sample data and shared by many messages, so that each message
+ * carries only the table's id in place of a tree. Every byte value has a code, so any message can
+ * be encoded with any table. The encode and decode tables are built when the table is trained or
+ * read, so coding a message does no setup.
+ */
+struct HuffmanTable {
+    int id = 0;
+    CanonicalEncodedData code;  // only the header fields are used
+    SymbolCode codes[256];
+    vector<CanonicalDecodeEntry> decodeTable;
+};
+
+/* Builds the encode and decode tables of table from its code lengths.
+ */
+void prepareTable(HuffmanTable& table) {
+    assignCanonicalCodes(table.code, table.codes);
+    table.decodeTable = buildCanonicalDecodeTable(table.code, table.code.maxCodeLength);
+}
+
+/**
+ * Train a shared table with the given id on the combined byte counts of samples, with no code
+ * longer than maxCodeLength bits (8 to MAX_SINGLE_LOOKUP_BITS).
+ *
+ * Every byte value is counted once more than it occurs, so bytes missing from the samples still
+ * get a code, just a long one.
+ */
+HuffmanTable trainTable(const Vector<string>& samples, int id, int maxCodeLength = TABLE_CODE_LENGTH) {
+    if (maxCodeLength < 8 || maxCodeLength > MAX_SINGLE_LOOKUP_BITS)
+        error("Table code length limit must be between 8 and " + integerToString(MAX_SINGLE_LOOKUP_BITS) + ".");
+    if (id < 0)
+        error("Table id must not be negative.");
+    uint64_t counts[256];
+    fill(counts, counts + 256, 1);
+    for (const string& sample : samples) {
+        countFrequencies(reinterpret_cast<const uint8_t*>(sample.data()), sample.size(), counts);
+    }
+    int codeLengths[256] = { 0 };
+    limitedCodeLengths(counts, maxCodeLength, codeLengths);
+    HuffmanTable table;
+    table.id = id;
+    setCanonicalHeader(codeLengths, table.code);
+    table.code.maxCodeLength = maxCodeLength;
+    prepareTable(table);
+    return table;
+}
+
+/* Writes table to out as TABLE_MAGIC, TABLE_VERSION, the id and its canonical header.
+ */
+void writeTable(ostream& out, const HuffmanTable& table) {
+    out.write(TABLE_MAGIC, sizeof(TABLE_MAGIC));
+    writeBigEndian(out, TABLE_VERSION, 1);
+    writeBigEndian(out, table.id, 4);
+    writeCanonicalHeader(out, table.code);
+}
+
+/* Reads back a table written by writeTable, reporting an error if it is not a valid table.
+ */
+HuffmanTable readTable(istream& in) {
+    char magic[sizeof(TABLE_MAGIC)];
+    in.read(magic, sizeof(magic));
+    if (!in || memcmp(magic, TABLE_MAGIC, sizeof(magic)) != 0 || readBigEndian(in, 1) != TABLE_VERSION)
+        error("Input is not a Huffman table.");
+    HuffmanTable table;
+    table.id = readBigEndian(in, 4);
+    readCanonicalHeader(in, table.code);
+    if (table.id < 0 || table.code.symbols.size() != 256 || table.code.maxCodeLength < 8
+            || table.code.maxCodeLength > MAX_SINGLE_LOOKUP_BITS)
+        error("Huffman table is corrupt.");
+    prepareTable(table);
+    return table;
+}
+
+/* Appends value to out as a varint: seven bits per byte, low bits first, with the top bit set on
+ * every byte but the last. Small values, like the lengths of short messages, take one byte.
+ */
+void appendVarint(string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out += (char) ((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    out += (char) value;
+}
+
+/* Reads a varint written by appendVarint from in at pos, advancing pos past it.
+ */
+uint64_t readVarint(string_view in, size_t& pos) {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (pos >= in.size())
+            error("Compressed message ended unexpectedly.");
+        uint8_t byte = in[pos++];
+        value |= (uint64_t) (byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) return value;
+    }
+    error("Compressed message has a corrupt header.");
+}
+
+/**
+ * Compress text with a shared table. The result is the table id and the text length as varints,
+ * then the message bits, so a short message costs two or three bytes on top of its codes.
+ */
+string compressWithTable(string_view text, const HuffmanTable& table) {
+    string compressed;
+    appendVarint(compressed, table.id);
+    appendVarint(compressed, text.size());
+    BitBuffer messageBits;
+    encodeWithCodes(table.codes, reinterpret_cast<const uint8_t*>(text.data()), text.size(), messageBits);
+    compressed.append(reinterpret_cast<const char*>(messageBits.bytes()), (messageBits.size() + 7) / 8);
+    return compressed;
+}
+
+/* Returns the id of the table a message from compressWithTable was compressed with, so the
+ * receiver can pick the table to decompress it with. Reports an error if the id is larger than
+ * any table's, which would otherwise be narrowed into some other table's id.
+ */
+int messageTableId(string_view compressed) {
+    size_t pos = 0;
+    uint64_t id = readVarint(compressed, pos);
+    if (id > 0x7FFFFFFF)
+        error("Compressed message has a corrupt table id.");
+    return id;
+}
+
+/**
+ * Decompress a message written by compressWithTable with the same table.
+ *
+ * Reports an error if the message was compressed with a different table, or is truncated or
+ * corrupt.
+ */
+string decompressWithTable(string_view compressed, const HuffmanTable& table) {
+    size_t pos = 0;
+    if (readVarint(compressed, pos) != (uint64_t) table.id)
+        error("Compressed message was not compressed with this table.");
+    uint64_t length = readVarint(compressed, pos);
+    // The buffer's zero padding lets the last lookups read past the end of the message
+    BitBuffer messageBits;
+    messageBits.assign(reinterpret_cast<const uint8_t*>(compressed.data()) + pos, (compressed.size() - pos) * 8);
+    uint64_t bitCount = messageBits.size();
+    if (length > bitCount)
+        error("Compressed message is truncated.");
+    string text(length, '\0');
+    int tableBits = table.code.maxCodeLength;
+    uint64_t bitPos = 0;
+    for (uint64_t i = 0; i < length; i++) {
+        const CanonicalDecodeEntry& entry = table.decodeTable[peekBitsAt(messageBits.bytes(), bitPos, tableBits)];
+        if (entry.length == 0)
+            error("Message bits do not match any code in the table.");
+        text[i] = entry.symbol;
+        bitPos += entry.length;
+        if (bitPos > bitCount)
+            error("Compressed message is truncated.");
+    }
+    return text;
+}
+
+/* * * * * * Adaptive Huffman Coding * * * * * */
+
+/* Symbols of the adaptive code besides the bytes: ADAPTIVE_END marks the end of a message and
+ * ADAPTIVE_NYT is the leaf standing for every symbol not yet transmitted.
+ */
+const int ADAPTIVE_END = 256;
+const int ADAPTIVE_NYT = 257;
+const int ADAPTIVE_INTERNAL = -1;
+
+/* Node number of the root of an adaptive code. New nodes take the next lower numbers, two for
+ * each symbol seen, so a tree over every byte value, ADAPTIVE_END and the NYT leaf, 515 nodes,
+ * numbers down to 0.
+ */
+const int ADAPTIVE_ROOT = 2 * (ADAPTIVE_END + 1);
+
+/* An adaptive Huffman code, updated after every symbol with the FGK algorithm, so the encoder and
+ * decoder build the same code from the symbols seen so far and no tree is ever sent. The first
+ * time a symbol is seen it is sent as the code of the NYT leaf followed by the symbol in 9 bits,
+ * and the NYT leaf splits into a new NYT leaf and a leaf for the symbol.
+ *
+ * Nodes are kept in flat arrays indexed by node number. Weights never decrease as the number
+ * rises (the sibling property), which keeps the tree a Huffman tree for the counts so far. To keep
+ * it, each node on the way from a symbol's leaf to the root is first swapped with the
+ * highest-numbered node of the same weight, then incremented.
+ */
+class AdaptiveHuffmanCode {
+public:
+    AdaptiveHuffmanCode() : nyt(ADAPTIVE_ROOT) {
+        fill(leafOf, leafOf + ADAPTIVE_END + 1, -1);
+        makeLeaf(ADAPTIVE_ROOT, ADAPTIVE_NYT, -1);
+    }
+
+    /* Appends the code for symbol (a byte or ADAPTIVE_END) to out, then updates the code. */
+    void encode(int symbol, BitBuffer& out) {
+        int leaf = leafOf[symbol];
+        writePath(leaf == -1 ? nyt : leaf, out);
+        if (leaf == -1) {
+            out.writeBits(symbol, 9);
+        }
+        update(symbol);
+    }
+
+    /* Reads one symbol from in, consuming its bits, then updates the code. Returns a byte or
+     * ADAPTIVE_END, and reports an error if in runs out partway through a code.
+     */
+    int decode(BitBuffer& in) {
+        int node = ADAPTIVE_ROOT;
+        while (symbolOf[node] == ADAPTIVE_INTERNAL) {
+            if (in.isEmpty())
+                error("Adaptive Huffman message ended unexpectedly.");
+            node = in.readBit() ? one[node] : zero[node];
+        }
+        int symbol = symbolOf[node];
+        if (symbol == ADAPTIVE_NYT) {
+            if (in.remaining() < 9)
+                error("Adaptive Huffman message ended unexpectedly.");
+            symbol = in.readBits(9);
+            if (symbol > ADAPTIVE_END || leafOf[symbol] != -1)
+                error("Adaptive Huffman message is corrupt.");
+        }
+        update(symbol);
+        return symbol;
+    }
+
+private:
+    void makeLeaf(int node, int symbol, int parentNode) {
+        symbolOf[node] = symbol;
+        weight[node] = 0;
+        parent[node] = parentNode;
+        zero[node] = one[node] = -1;
+    }
+
+    /* Writes the bits on the path from the root to node. The path is collected from the leaf up,
+     * into 64-bit chunks, and written from the top chunk down.
+     */
+    void writePath(int node, BitBuffer& out) {
+        uint64_t chunks[(ADAPTIVE_ROOT + 63) / 64] = { 0 };
+        int length = 0;
+        for (; node != ADAPTIVE_ROOT; node = parent[node]) {
+            chunks[length / 64] |= (uint64_t) (one[parent[node]] == node) << (length % 64);
+            length++;
+        }
+        if (length == 0) return;
+        int top = (length - 1) / 64;
+        out.writeBits(chunks[top], length - 64 * top);
+        for (int chunk = top - 1; chunk >= 0; chunk--) {
+            out.writeBits(chunks[chunk], 64);
+        }
+    }
+
+    void update(int symbol) {
+        int node = leafOf[symbol];
+        if (node == -1) {
+            // Split the NYT leaf: the new NYT leaf is its zero child and the symbol's its one child
+            int oldNyt = nyt;
+            node = oldNyt - 1;
+            nyt = oldNyt - 2;
+            makeLeaf(node, symbol, oldNyt);
+            makeLeaf(nyt, ADAPTIVE_NYT, oldNyt);
+            symbolOf[oldNyt] = ADAPTIVE_INTERNAL;
+            zero[oldNyt] = nyt;
+            one[oldNyt] = node;
+            leafOf[symbol] = node;
+        }
+        while (node != ADAPTIVE_ROOT) {
+            // The nodes of equal weight are numbered consecutively, so the highest is a short scan
+            int leader = node;
+            while (leader + 1 < ADAPTIVE_ROOT && weight[leader + 1] == weight[node]) {
+                leader++;
+            }
+            if (leader != node && leader != parent[node]) {
+                swapNodes(node, leader);
+                node = leader;
+            }
+            weight[node]++;
+            node = parent[node];
+        }
+        weight[ADAPTIVE_ROOT]++;
+    }
+
+    /* Swaps the subtrees at node numbers a and b, which have equal weights. Each number keeps its
+     * place under its parent, so only the contents move and their links are pointed back.
+     */
+    void swapNodes(int a, int b) {
+        swap(symbolOf[a], symbolOf[b]);
+        swap(zero[a], zero[b]);
+        swap(one[a], one[b]);
+        relink(a);
+        relink(b);
+    }
+
+    void relink(int node) {
+        if (symbolOf[node] == ADAPTIVE_INTERNAL) {
+            parent[zero[node]] = node;
+            parent[one[node]] = node;
+        } else if (symbolOf[node] == ADAPTIVE_NYT) {
+            nyt = node;
+        } else {
+            leafOf[symbolOf[node]] = node;
+        }
+    }
+
+    uint64_t weight[ADAPTIVE_ROOT + 1];
+    int parent[ADAPTIVE_ROOT + 1];
+    int zero[ADAPTIVE_ROOT + 1];
+    int one[ADAPTIVE_ROOT + 1];
+    int symbolOf[ADAPTIVE_ROOT + 1];  // a byte or ADAPTIVE_END for a leaf, ADAPTIVE_NYT, or ADAPTIVE_INTERNAL
+    int leafOf[ADAPTIVE_END + 1];     // node number of each symbol's leaf, or -1 if not yet seen
+    int nyt;
+};
+
+/**
+ * Compress text in a single pass with an adaptive Huffman code. There is no header: the codes
+ * start at the first bit, and ADAPTIVE_END marks the end of the message.
+ */
+string compressAdaptive(string_view text) {
+    AdaptiveHuffmanCode code;
+    BitBuffer messageBits;
+    for (char ch : text) {
+        code.encode((uint8_t) ch, messageBits);
+    }
+    code.encode(ADAPTIVE_END, messageBits);
+    return string(reinterpret_cast<const char*>(messageBits.bytes()), (messageBits.size() + 7) / 8);
+}
+
+/**
+ * Decompress data written by compressAdaptive or compressAdaptiveStream, reporting an error if it
+ * ends before its end marker.
+ */
+string decompressAdaptive(string_view compressed) {
+    AdaptiveHuffmanCode code;
+    BitBuffer messageBits;
+    messageBits.assign(reinterpret_cast<const uint8_t*>(compressed.data()), compressed.size() * 8);
+    string text = "";
+    for (int symbol = code.decode(messageBits); symbol != ADAPTIVE_END; symbol = code.decode(messageBits)) {
+        text += (char) symbol;
+    }
+    return text;
+}
+
+/* Bytes read at a time by the adaptive stream coders. Output is written as soon as each chunk is
+ * coded, so it is kept small.
+ */
+const size_t ADAPTIVE_CHUNK_SIZE = 4096;
+
+/* Writes the whole bytes of bits to out and keeps only the last partial byte in bits.
+ */
+void flushWholeBytes(BitBuffer& bits, ostream& out) {
+    uint64_t wholeBits = bits.size() & ~(uint64_t) 7;
+    out.write(reinterpret_cast<const char*>(bits.bytes()), wholeBits / 8);
+    int leftover = bits.size() - wholeBits;
+    uint64_t partial = leftover > 0 ? bits.peekAt(wholeBits, leftover) : 0;
+    bits = BitBuffer();
+    bits.writeBits(partial, leftover);
+}
+
+/**
+ * Compress everything readable from in to out in a single pass with an adaptive Huffman code,
+ * writing each chunk's bytes as soon as it has been coded. The output is the same as
+ * compressAdaptive's.
+ */
+void compressAdaptiveStream(istream& in, ostream& out) {
+    AdaptiveHuffmanCode code;
+    BitBuffer bits;
+    char chunk[ADAPTIVE_CHUNK_SIZE];
+    while (in) {
+        in.read(chunk, sizeof(chunk));
+        for (streamsize i = 0; i < in.gcount(); i++) {
+            code.encode((uint8_t) chunk[i], bits);
+        }
+        flushWholeBytes(bits, out);
+    }
+    code.encode(ADAPTIVE_END, bits);
+    out.write(reinterpret_cast<const char*>(bits.bytes()), (bits.size() + 7) / 8);
+}
+
+/**
+ * Decompress an adaptive Huffman stream from in to out, reading a chunk at a time. Every code is
+ * shorter than ADAPTIVE_ROOT + 9 bits, so a symbol is only decoded once at least that many bits
+ * are buffered, or the input has ended.
+ */
+void decompressAdaptiveStream(istream& in, ostream& out) {
+    AdaptiveHuffmanCode code;
+    BitBuffer bits;
+    char chunk[ADAPTIVE_CHUNK_SIZE];
+    string text = "";
+    while (true) {
+        if (bits.remaining() < ADAPTIVE_ROOT + 9 && in) {
+            // Move the unread bits to the front of a fresh buffer and append the next chunk
+            in.read(chunk, sizeof(chunk));
+            BitBuffer refilled;
+            while (bits.remaining() >= 57) {
+                refilled.writeBits(bits.readBits(57), 57);
+            }
+            int rest = bits.remaining();
+            if (rest > 0) refilled.writeBits(bits.readBits(rest), rest);
+            for (streamsize i = 0; i < in.gcount(); i++) {
+                refilled.writeBits((uint8_t) chunk[i], 8);
+            }
+            bits = move(refilled);
+            continue;
+        }
+        int symbol = code.decode(bits);
+        if (symbol == ADAPTIVE_END) break;
+        text += (char) symbol;
+        if (text.size() == ADAPTIVE_CHUNK_SIZE) {
+            out.write(text.data(), text.size());
+            text.clear();
+        }
+    }
+    out.write(text.data(), text.size());
+}
+
+/* * * * * * Order-1 Context Modeling * * * * * */
+
+/* Most Huffman tables an order-1 model may use, and the default number. */
+const int ORDER1_MAX_TABLES = 16;
+const int ORDER1_DEFAULT_TABLES = 8;
+
+/* Code length limit of each order-1 table, so each decode is one lookup in a 4096-entry table and
+ * eight tables still fit in L1 cache.
+ */
+const int ORDER1_CODE_LENGTH = 12;
+
+/* Rounds of reassigning contexts to tables when clustering. */
+const int ORDER1_CLUSTER_ROUNDS = 6;
+
+/* A message coded with an order-1 model: each byte is coded with the table chosen for the byte
+ * before it. The 256 previous-byte contexts are clustered into a few tables, and contextTable
+ * records which table each context uses. The first byte is coded in context 0.
+ */
+struct Order1EncodedData {
+    Vector<CanonicalEncodedData> tables;  // only the header fields are used
+    uint8_t contextTable[256] = { 0 };
+    BitBuffer messageBits;
+    uint64_t symbolCount = 0;
+};
+
+/* Fills bits[s] with an estimate of the code length, in bits, of symbol s under the histogram
+ * of a cluster. Half a count is added to every symbol so a symbol the cluster has not seen yet
+ * costs a finite amount.
+ */
+void estimateCodeLengths(const uint64_t histogram[256], double bits[256]) {
+    double total = 128;
+    for (int symbol = 0; symbol < 256; symbol++) {
+        total += histogram[symbol];
+    }
+    for (int symbol = 0; symbol < 256; symbol++) {
+        bits[symbol] = -log2((histogram[symbol] + 0.5) / total);
+    }
+}
+
+/* Groups the contexts with a byte histogram into at most tableCount clusters, like k-means: seed
+ * the clusters with the busiest contexts, then repeatedly move every context to the cluster that
+ * would code it in the fewest bits and recompute the cluster histograms. Fills contextTable and
+ * returns the histograms of the clusters that ended up in use.
+ */
+Vector<Vector<uint64_t>> clusterContexts(const vector<uint64_t>& counts, int tableCount, uint8_t contextTable[256]) {
+    Vector<int> contexts;
+    uint64_t totals[256] = { 0 };
+    for (int context = 0; context < 256; context++) {
+        for (int symbol = 0; symbol < 256; symbol++) {
+            totals[context] += counts[context * 256 + symbol];
+        }
+        if (totals[context] > 0) contexts.add(context);
+    }
+    stable_sort(contexts.begin(), contexts.end(), [&](int a, int b) { return totals[a] > totals[b]; });
+    int clusterCount = min(tableCount, contexts.size());
+    for (int i = 0; i < contexts.size(); i++) {
+        contextTable[contexts[i]] = i < clusterCount ? i : 0;
+    }
+    Vector<Vector<uint64_t>> histograms;
+    for (int round = 0; round <= ORDER1_CLUSTER_ROUNDS; round++) {
+        histograms = Vector<Vector<uint64_t>>(clusterCount, Vector<uint64_t>(256, 0));
+        for (int context : contexts) {
+            for (int symbol = 0; symbol < 256; symbol++) {
+                histograms[contextTable[context]][symbol] += counts[context * 256 + symbol];
+            }
+        }
+        if (round == ORDER1_CLUSTER_ROUNDS) break;
+        vector<double> bits(clusterCount * 256);
+        for (int cluster = 0; cluster < clusterCount; cluster++) {
+            uint64_t histogram[256];
+            copy(histograms[cluster].begin(), histograms[cluster].end(), histogram);
+            estimateCodeLengths(histogram, &bits[cluster * 256]);
+        }
+        for (int context : contexts) {
+            double bestCost = 0;
+            for (int cluster = 0; cluster < clusterCount; cluster++) {
+                double cost = 0;
+                for (int symbol = 0; symbol < 256; symbol++) {
+                    cost += counts[context * 256 + symbol] * bits[cluster * 256 + symbol];
+                }
+                if (cluster == 0 || cost < bestCost) {
+                    bestCost = cost;
+                    contextTable[context] = cluster;
+                }
+            }
+        }
+    }
+    // Drop clusters that lost all their contexts, renumbering the rest
+    int renumbered[ORDER1_MAX_TABLES];
+    Vector<Vector<uint64_t>> used;
+    for (int cluster = 0; cluster < clusterCount; cluster++) {
+        bool empty = true;
+        for (uint64_t count : histograms[cluster]) {
+            if (count > 0) empty = false;
+        }
+        renumbered[cluster] = used.size();
+        if (!empty) used.add(histograms[cluster]);
+    }
+    for (int context : contexts) {
+        contextTable[context] = renumbered[contextTable[context]];
+    }
+    return used;
+}
+
+/**
+ * Compress text with an order-1 model of at most tableCount (1 to ORDER1_MAX_TABLES) Huffman
+ * tables, each limited to ORDER1_CODE_LENGTH bits. On text where each byte depends strongly on the
+ * one before, this takes far fewer bits than a single order-0 code, at the cost of a header of
+ * 256 context bytes and a code length header per table.
+ */
+Order1EncodedData compressOrder1(string_view text, int tableCount = ORDER1_DEFAULT_TABLES) {
+    if (tableCount < 1 || tableCount > ORDER1_MAX_TABLES)
+        error("Order-1 table count must be between 1 and " + integerToString(ORDER1_MAX_TABLES) + ".");
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(text.data());
+    vector<uint64_t> counts(256 * 256, 0);
+    uint8_t previous = 0;
+    for (size_t i = 0; i < text.size(); i++) {
+        counts[previous * 256 + bytes[i]]++;
+        previous = bytes[i];
+    }
+    Order1EncodedData data;
+    Vector<Vector<uint64_t>> histograms = clusterContexts(counts, tableCount, data.contextTable);
+    vector<SymbolCode> codes(histograms.size() * 256);
+    for (int table = 0; table < histograms.size(); table++) {
+        uint64_t histogram[256];
+        copy(histograms[table].begin(), histograms[table].end(), histogram);
+        int codeLengths[256] = { 0 };
+        limitedCodeLengths(histogram, ORDER1_CODE_LENGTH, codeLengths);
+        CanonicalEncodedData header;
+        setCanonicalHeader(codeLengths, header);
+        header.maxCodeLength = ORDER1_CODE_LENGTH;
+        assignCanonicalCodes(header, &codes[table * 256]);
+        data.tables.add(header);
+    }
+    BitWriter writer(data.messageBits);
+    previous = 0;
+    for (size_t i = 0; i < text.size(); i++) {
+        const SymbolCode& code = codes[data.contextTable[previous] * 256 + bytes[i]];
+        writer.writeBits(code.bits, code.length);
+        previous = bytes[i];
+    }
+    writer.flush();
+    data.symbolCount = text.size();
+    return data;
+}
+
+/**
+ * Decompress order-1 data, consuming its message bits. The decode tables of all the clusters sit
+ * side by side in one array, and each context's offset into it is worked out up front, so each
+ * symbol is a single lookup.
+ *
+ * Reports an error if the message bits are corrupt.
+ */
+string decompress(Order1EncodedData& data) {
+    vector<CanonicalDecodeEntry> tables;
+    for (const CanonicalEncodedData& header : data.tables) {
+        vector<CanonicalDecodeEntry> table = buildCanonicalDecodeTable(header, ORDER1_CODE_LENGTH);
+        tables.insert(tables.end(), table.begin(), table.end());
+    }
+    size_t offsets[256];
+    for (int context = 0; context < 256; context++) {
+        if (data.symbolCount > 0 && data.contextTable[context] >= data.tables.size())
+            error("Order-1 context table is corrupt.");
+        offsets[context] = (size_t) data.contextTable[context] << ORDER1_CODE_LENGTH;
+    }
+    BitBuffer& messageBits = data.messageBits;
+    const uint8_t* bytes = messageBits.bytes();
+    uint64_t pos = messageBits.readPosition();
+    uint64_t end = messageBits.size();
+    string text(data.symbolCount, '\0');
+    uint8_t previous = 0;
+    for (uint64_t i = 0; i < data.symbolCount; i++) {
+        const CanonicalDecodeEntry& entry = tables[offsets[previous] + peekBitsAt(bytes, pos, ORDER1_CODE_LENGTH)];
+        if (entry.length == 0 || pos > end)
+            error("Compressed message bits are corrupt.");
+        text[i] = entry.symbol;
+        pos += entry.length;
+        previous = entry.symbol;
+    }
+    messageBits.skip(messageBits.remaining());
+    return text;
+}
+
+/* Writes order-1 data to out: the table count, the table of each of the 256 contexts, each
+ * table's canonical header, then the message bits as writeCanonicalData writes them.
+ */
+void writeOrder1Data(ostream& out, const Order1EncodedData& data) {
+    writeBigEndian(out, data.tables.size(), 1);
+    out.write(reinterpret_cast<const char*>(data.contextTable), 256);
+    for (const CanonicalEncodedData& header : data.tables) {
+        writeCanonicalHeader(out, header);
+    }
+    writeBigEndian(out, data.symbolCount, 8);
+    writeBigEndian(out, data.messageBits.size(), 8);
+    out.write(reinterpret_cast<const char*>(data.messageBits.bytes()), (data.messageBits.size() + 7) / 8);
+}
+
+/* Reads back data written by writeOrder1Data, reporting an error if it is corrupt or truncated.
+ * As with readCanonicalData, the message can be no longer than maxBits when the caller knows how
+ * much input there is, and is read a chunk at a time otherwise, so a forged symbol and bit count
+ * never allocate more than the input holds.
+ */
+void readOrder1Data(istream& in, Order1EncodedData& data, uint64_t maxBits = ~(uint64_t) 0) {
+    int tableCount = readBigEndian(in, 1);
+    if (tableCount > ORDER1_MAX_TABLES)
+        error("Compressed stream has a corrupt table count.");
+    in.read(reinterpret_cast<char*>(data.contextTable), 256);
+    data.tables.clear();
+    for (int table = 0; table < tableCount; table++) {
+        CanonicalEncodedData header;
+        readCanonicalHeader(in, header);
+        if (header.maxCodeLength != ORDER1_CODE_LENGTH)
+            error("Compressed stream has a corrupt code length header.");
+        data.tables.add(header);
+    }
+    data.symbolCount = readBigEndian(in, 8);
+    uint64_t bitCount = readBigEndian(in, 8);
+    if (data.symbolCount > bitCount)
+        error("Compressed stream has a corrupt symbol count.");
+    // Every code is at most ORDER1_CODE_LENGTH bits, which ties the bits to the symbol count
+    if (bitCount > maxBits || data.symbolCount < bitCount / ORDER1_CODE_LENGTH + (bitCount % ORDER1_CODE_LENGTH != 0))
+        error("Compressed stream has a corrupt bit count.");
+    readMessageBits(in, bitCount, data.messageBits);
+}
+
+/* * * * * * Command-Line Tool * * * * * */
+
+/* Times each phase of compressing and decompressing text in memory, with the canonical code that
+ * huff c and huff d write: the byte histogram, building the code from it, encoding and decoding.
+ * compressedSize is set to the size of the canonical header and message bits. Reports an error if
+ * text is empty, which has no phases to time, or if the decoded text does not match the input.
+ */
+Vector<PhaseTime> timePhases(string_view text, uint64_t& compressedSize) {
+    if (text.empty())
+        error("Benchmark input is empty.");
+    Vector<PhaseTime> phases;
+    PhaseClock clock(&phases);
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(text.data());
+    uint64_t counts[256] = { 0 };
+    countFrequencies(bytes, text.size(), counts);
+    clock.endPhase("histogram");
+    CanonicalEncodedData data;
+    SymbolCode codes[256];
+    prepareCanonical(counts, text.size(), 0, 1, data, codes);
+    clock.endPhase("code build");
+    encodeWithCodes(codes, bytes, text.size(), data.messageBits);
+    clock.endPhase("encode");
+    string decoded(text.size(), '\0');
+    decodeCanonicalInto(data, data.messageBits.bytes(), 0, data.messageBits.size(), &decoded[0]);
+    clock.endPhase("decode");
+    if (decoded != text)
+        error("Decoded text does not match the input.");
+    ostringstream header;
+    writeCanonicalHeader(header, data);
+    compressedSize = header.str().size() + 8 + (data.messageBits.size() + 7) / 8;
+    return phases;
+}
+
+/* Building the tool and the benchmark runner. Each is built from this file in place of the test
+ * runner, so its build defines exactly one of HUFFMAN_TOOL or HUFFMAN_BENCHMARK (see the Benchmark
+ * Suite below) and leaves out the project's main.cpp, whose main is the test runner's. In the Qt
+ * Creator project, add to the .pro file:
+ *
+ *     DEFINES += HUFFMAN_TOOL          (or HUFFMAN_BENCHMARK)
+ *     SOURCES -= main.cpp
+ *
+ * From a shell, with STANFORD_LIB the directory holding the built Stanford library and its
+ * headers:
+ *
+ *     g++ -std=c++17 -O2 -pthread -DHUFFMAN_TOOL -I. -I$STANFORD_LIB/include \
+ *         huffman.cpp -L$STANFORD_LIB -lStanfordCPPLib -o huff
+ *     g++ -std=c++17 -O2 -pthread -DHUFFMAN_BENCHMARK -I. -I$STANFORD_LIB/include \
+ *         huffman.cpp -L$STANFORD_LIB -lStanfordCPPLib -o huff_benchmark
+ *
+ * then, for example, ./huff_benchmark --format=json > results.json.
+ */
+
+#ifdef HUFFMAN_TOOL
+
+/* Prints one line of timing for a phase that handled the given number of bytes.
+ */
+void printPhase(const string& phase, uint64_t bytes, double seconds) {
+    cout << "  " << left << setw(12) << phase << right << fixed << setprecision(3)
+         << setw(10) << seconds * 1000 << " ms" << setprecision(1)
+         << setw(10) << bytes / (1024.0 * 1024.0) / seconds << " MB/s" << endl;
+}
+
+/* Prints the sizes of an input and its compressed form and the ratio between them.
+ */
+void printSizes(uint64_t rawSize, uint64_t compressedSize) {
+    cout << "  raw:        " << rawSize << " bytes" << endl;
+    cout << "  compressed: " << compressedSize << " bytes" << endl;
+    cout << "  ratio:      " << fixed << setprecision(2)
+         << (rawSize == 0 ? 0.0 : 100.0 * compressedSize / rawSize) << "%" << endl;
+}
+
+/* Prints one line of timing for each phase, each of which handled the given number of bytes,
+ * then the total.
+ */
+void printPhases(const Vector<PhaseTime>& phases, uint64_t bytes) {
+    double total = 0;
+    for (const PhaseTime& phase : phases) {
+        printPhase(phase.phase, bytes, phase.seconds);
+        total += phase.seconds;
+    }
+    printPhase("total", bytes, total);
+}
+
+/* Times each phase of compress and decompress separately on the file at path with timePhases and
+ * prints the results.
+ */
+void benchmarkFile(const string& path) {
+    MappedFile input(path);
+    string_view text(reinterpret_cast<const char*>(input.data()), input.size());
+    uint64_t compressedSize = 0;
+    Vector<PhaseTime> phases = timePhases(text, compressedSize);
+    cout << path << endl;
+    printSizes(text.size(), compressedSize);
+    printPhases(phases, text.size());
+}
+
+/* The huff command-line tool, built in place of the test runner when HUFFMAN_TOOL is defined:
+ *
+ *     huff c <in> <out>     compress in to out with compressFile
+ *     huff d <in> <out>     decompress in to out with decompressFile
+ *     huff bench <in>       time each phase of compress and decompress on in, in memory
+ *
+ * c and d print the time and throughput of each phase of compressFile or decompressFile.
+ */
+int main(int argc, char* argv[]) {
+    string command = argc > 1 ? argv[1] : "";
+    if (!((command == "c" || command == "d") && argc == 4) && !(command == "bench" && argc == 3)) {
+        cerr << "usage: huff c|d <in> <out>" << endl;
+        cerr << "       huff bench <in>" << endl;
+        return 2;
+    }
+    try {
+        if (command == "bench") {
+            benchmarkFile(argv[2]);
+            return 0;
+        }
+        Vector<PhaseTime> phases;
+        if (command == "c") {
+            compressFile(argv[2], argv[3], FILE_KIND_CANONICAL, 0, 1, &phases);
+        } else {
+            decompressFile(argv[2], argv[3], &phases);
+        }
+        uint64_t inSize = MappedFile(argv[2]).size();
+        uint64_t outSize = MappedFile(argv[3]).size();
+        cout << argv[2] << " -> " << argv[3] << endl;
+        if (command == "c") {
+            printSizes(inSize, outSize);
+            printPhases(phases, inSize);
+        } else {
+            printSizes(outSize, inSize);
+            printPhases(phases, outSize);
+        }
+    } catch (const exception& e) {
+        cerr << "huff: " << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
+
+#endif
+
+/* * * * * * Testing Helper Functions Below This Point * * * * * */
+
+/* Manually create the leaf nodes and parent nodes of the given example tree
+ */
+EncodingTreeNode* createExampleTree() {
+    /* Example encoding tree used in multiple test cases:
+     *                *
+     *              /   \
+     *             T     *
+     *                  / \
+     *                 *   E
+     *                / \
+     *               R   S
+     */
+    EncodingTreeNode* charT = new EncodingTreeNode('T');
+    EncodingTreeNode* charR = new EncodingTreeNode('R');
+    EncodingTreeNode* charS = new EncodingTreeNode('S');
+    EncodingTreeNode* charE = new EncodingTreeNode('E');
+    EncodingTreeNode* parRS = new EncodingTreeNode(charR, charS);
+    EncodingTreeNode* parE = new EncodingTreeNode(parRS, charE);
+    EncodingTreeNode* par = new EncodingTreeNode(charT, parE);
+    return par;
+}
+
+/* The same example tree as createExampleTree, with its nodes allocated in arena.
+ */
+EncodingTreeNode* createExampleTree(TreeArena& arena) {
+    EncodingTreeNode* charT = arena.newLeaf('T');
+    EncodingTreeNode* charR = arena.newLeaf('R');
+    EncodingTreeNode* charS = arena.newLeaf('S');
+    EncodingTreeNode* charE = arena.newLeaf('E');
+    EncodingTreeNode* parRS = arena.newParent(charR, charS);
+    EncodingTreeNode* parE = arena.newParent(parRS, charE);
+    return arena.newParent(charT, parE);
+}
+
+/* Run through each node, in the zero and one direction, deleting each node as it traverses.
+ */
+void deallocateTree(EncodingTreeNode* t) {
+      if (t->isLeaf() == false) {
+        if (t->zero != nullptr) deallocateTree(t->zero);
+        if (t->one != nullptr) deallocateTree(t->one);
+      }
+      delete t;
+}
+
+/* Check that the two trees are identical.
+ */
+bool areEqual(EncodingTreeNode* a, EncodingTreeNode* b) {
+    // Check if one of the equal positioned nodes is a leaf and the other it not
+    if (a->isLeaf() && !b->isLeaf())
+        return false;
+    if (!a->isLeaf() && b->isLeaf())
+        return false;
+    // Check if the equal positioned leaves have different characters assigned to them
+    else if (a->isLeaf() && b->isLeaf()) {
+        if (a->getChar() != b->getChar()) {
+            return false;
+        }
+    }
+    else {
+        // Recurse through the trees as long as they are not nullptrs
+        if (a->zero != nullptr && b->zero != nullptr)
+            areEqual(a->zero, b->zero);
+        if (a->one != nullptr && b->one != nullptr)
+            areEqual(a->one, b->one);
+        // If one of the two is a nullptr and the other isnt, return false
+        if (a->zero == nullptr && b->zero != nullptr)
+            return !(a->zero != nullptr && b->zero == nullptr);
+        if (a->one == nullptr && b->one != nullptr)
+            return !(a->one != nullptr && b->one == nullptr);
+    }
+    return true;
+}
+
+/* Generate length characters of English-like text, drawing letters with their usual English
+ * frequencies so the Huffman codes look like those of real text. The seed makes it repeatable.
+ */
+string generateText(int length, int seed) {
+    const string letters = " etaoinshrdlcumwfgypbvkjxqz";
+    const int weights[] = { 180, 102, 75, 65, 62, 57, 57, 51, 50, 49, 34, 33, 23, 23, 20, 19,
+                            18, 16, 16, 15, 12, 8, 6, 1, 1, 1, 1 };
+    int totalWeight = 0;
+    for (int weight : weights) totalWeight += weight;
+    setRandomSeed(seed);
+    string text(length, ' ');
+    for (int i = 0; i < length; i++) {
+        int pick = randomInteger(0, totalWeight - 1);
+        int j = 0;
+        while (pick >= weights[j]) {
+            pick -= weights[j];
+            j++;
+        }
+        text[i] = letters[j];
+    }
+    return text;
+}
+
+/* This recursive helper function counts the frequency of the this specific parent given the children to have the
+ * priority queue organize this frequency.
+ */
+int textFrequency(EncodingTreeNode* parent, Map<char, int> letterMap) {
+    if (parent->isLeaf()) {
+        return letterMap[parent->getChar()];
+    } else {
+        return textFrequency(parent->one, letterMap) + textFrequency(parent->zero, letterMap);
+    }
+}
+
+/* The original tree builder, which weighs each new parent by walking its subtree with
+ * textFrequency and copies the letter map on every call. It is kept as the reference that
+ * buildHuffmanTree's construction time is compared against, and builds the same tree.
+ */
+EncodingTreeNode* buildHuffmanTreeByTextFrequency(const string& text) {
+    PriorityQueue<EncodingTreeNode*> treeQueue;
+    uint64_t counts[256] = { 0 };
+    countFrequencies(reinterpret_cast<const unsigned char*>(text.data()), text.size(), counts);
+    Map<char, int> letterMap;
+    for (int letter = 0; letter < 256; letter++) {
+        uint64_t count = counts[letter];
+        if (count > 0) {
+            letterMap[(char) letter] = count;
+            treeQueue.enqueue(new EncodingTreeNode((char) letter), count);
+        }
+    }
+    while (treeQueue.size() >= 2) {
+        EncodingTreeNode* leftNode = treeQueue.dequeue();
+        EncodingTreeNode* rightNode = treeQueue.dequeue();
+        EncodingTreeNode* parent = new EncodingTreeNode(leftNode, rightNode);
+        int totFrequency = textFrequency(parent, letterMap);
+        treeQueue.enqueue(parent, totFrequency);
+    }
+    return treeQueue.dequeue();
+}
+
+/* Text that uses exactly alphabetSize distinct byte values, each with a different frequency.
+ */
+string textWithAlphabet(int alphabetSize) {
+    string text = "";
+    for (int symbol = 0; symbol < alphabetSize; symbol++) {
+        text += string(symbol % 23 + 1, (char) symbol);
+    }
+    return text;
+}
+
+/* Text of the first symbols letters from 'a', each occurring as often as the next Fibonacci
+ * number, 1, 1, 2, 3, 5 and so on. Such counts give the most skewed Huffman tree there is, one
+ * level deeper for each letter, so 14 letters give codes up to 13 bits long.
+ */
+string fibonacciText(int symbols) {
+    string text = "";
+    int a = 1, b = 1;
+    for (int symbol = 0; symbol < symbols; symbol++) {
+        text += string(a, (char) ('a' + symbol));
+        int next = a + b;
+        a = b;
+        b = next;
+    }
+    return text;
+}
+
+/* Total encoded length in bits of text under tree, the quantity a Huffman tree minimizes.
+ */
+uint64_t encodedCost(EncodingTreeNode* tree, const string& text) {
+    int codeLengths[256] = { 0 };
+    codeLengthsFromTree(tree, 0, codeLengths);
+    uint64_t cost = 0;
+    for (char letter : text) {
+        cost += codeLengths[(uint8_t) letter];
+    }
+    return cost;
+}
+
+/* * * * * * Benchmark Suite * * * * * */
+
+#ifdef HUFFMAN_BENCHMARK
+
+#ifdef HUFFMAN_TOOL
+#error "HUFFMAN_TOOL and HUFFMAN_BENCHMARK each provide main; define only one."
+#endif
+
+/* The Queue-based functions store a whole node per bit, so they are only run on inputs up to
+ * this size; the packed versions run on every size.
+ */
+const size_t QUEUE_BENCHMARK_MAX = 1 << 22;
+
+/* One row of benchmark output: how many times the operation ran and how long that took in all.
+ */
+struct BenchmarkResult {
+    string name;
+    string corpus;
+    size_t bytes;
+    int iterations;
+    double seconds;
+};
+
+/* Returns length bytes of the named corpus: English-like text, uniformly random bytes, bytes
+ * with geometrically falling frequencies, long runs of a few repeated bytes, or a two-letter
+ * alphabet with one letter three times as common as the other.
+ */
+string benchmarkCorpus(const string& corpus, size_t length) {
+    if (corpus == "english") return generateText(length, 1);
+    if (corpus == "runs") {
+        string text = "";
+        for (int run = 0; text.size() < length; run++) {
+            text += string(16 + run % 112, (char) (run % 7));
+        }
+        text.resize(length);
+        return text;
+    }
+    setRandomSeed(2);
+    string text(length, '\0');
+    for (size_t i = 0; i < length; i++) {
+        if (corpus == "random") {
+            text[i] = (char) randomInteger(0, 255);
+        } else if (corpus == "skewed") {
+            int symbol = 0;
+            while (symbol < 255 && randomChance(0.5)) symbol++;
+            text[i] = (char) symbol;
+        } else {
+            text[i] = randomChance(0.75) ? 'a' : 'b';
+        }
+    }
+    return text;
+}
+
+/* Runs operation repeatedly until it has taken at least minSeconds in all, running setup untimed
+ * before each run, and records the result. Like Google Benchmark, the timed runs are summed so a
+ * fast operation is measured over many runs rather than one.
+ */
+void runBenchmark(Vector<BenchmarkResult>& results, const string& name, const string& corpus, size_t bytes,
+                  double minSeconds, function<void()> setup, function<void()> operation) {
+    BenchmarkResult result = { name, corpus, bytes, 0, 0 };
+    while (result.seconds < minSeconds) {
+        setup();
+        result.seconds += secondsFor(operation);
+        result.iterations++;
+    }
+    results.add(result);
+}
+
+/* Benchmarks every stage of the pipeline on text, in both its Queue-based and packed forms.
+ */
+void benchmarkCorpusText(Vector<BenchmarkResult>& results, const string& corpus, const string& text, double minSeconds) {
+    size_t size = text.size();
+    // A string argument would pick the by-value overloads and time a copy of the corpus as well
+    string_view view(text);
+    auto nothing = []() {};
+    uint64_t counts[256];
+    runBenchmark(results, "countFrequencies", corpus, size, minSeconds, [&]() {
+        fill(counts, counts + 256, 0);
+    }, [&]() {
+        countFrequencies(reinterpret_cast<const uint8_t*>(text.data()), size, counts);
+    });
+
+    // Each kernel the processor supports, whichever one countFrequencies picks
+    for (const NamedHistogramKernel& named : availableHistogramKernels()) {
+        runBenchmark(results, "countFrequencies/" + named.name, corpus, size, minSeconds, [&]() {
+            fill(counts, counts + 256, 0);
+        }, [&]() {
+            countFrequenciesWith(named.kernel, reinterpret_cast<const uint8_t*>(text.data()), size, counts);
+        });
+    }
+
+    // The Map<char, int> count the flat histogram replaced
+    runBenchmark(results, "countFrequencies/map", corpus, size, minSeconds, nothing, [&]() {
+        Map<char, int> letterMap;
+        for (char letter : text) letterMap[letter]++;
+    });
+
+    TreeArena arena;
+    EncodingTreeNode* tree = nullptr;
+    runBenchmark(results, "buildHuffmanTree", corpus, size, minSeconds, [&]() {
+        if (tree != nullptr) deallocateTree(tree);
+    }, [&]() {
+        tree = buildHuffmanTree(view);
+    });
+
+    // The same trees in a reused arena instead of one new and delete per node
+    runBenchmark(results, "buildHuffmanTree/arena", corpus, size, minSeconds, [&]() {
+        arena.clear();
+    }, [&]() {
+        buildHuffmanTree(view, arena);
+    });
+
+    // The original builder, which weighs each parent by walking its subtree
+    EncodingTreeNode* reference = nullptr;
+    runBenchmark(results, "buildHuffmanTree/textFrequency", corpus, size, minSeconds, [&]() {
+        if (reference != nullptr) deallocateTree(reference);
+    }, [&]() {
+        reference = buildHuffmanTreeByTextFrequency(text);
+    });
+    deallocateTree(reference);
+
+    Queue<Bit> treeShape;
+    Queue<char> treeLeaves;
+    runBenchmark(results, "flattenTree", corpus, size, minSeconds, [&]() {
+        treeShape.clear();
+        treeLeaves.clear();
+    }, [&]() {
+        flattenTree(tree, treeShape, treeLeaves);
+    });
+
+    Queue<Bit> shapeCopy;
+    Queue<char> leavesCopy;
+    runBenchmark(results, "unflattenTree", corpus, size, minSeconds, [&]() {
+        arena.clear();
+        shapeCopy = treeShape;
+        leavesCopy = treeLeaves;
+    }, [&]() {
+        unflattenTree(shapeCopy, leavesCopy, arena);
+    });
+
+    BitBuffer messageBits;
+    runBenchmark(results, "encodeText/packed", corpus, size, minSeconds, [&]() {
+        messageBits = BitBuffer();
+    }, [&]() {
+        encodeText(tree, text, messageBits);
+    });
+
+    BitBuffer bitsCopy;
+    runBenchmark(results, "decodeText/packed", corpus, size, minSeconds, [&]() {
+        bitsCopy = messageBits;
+    }, [&]() {
+        decodeText(tree, bitsCopy);
+    });
+
+    // Canonical decoding of 1, 4 and 8 interleaved streams, with codes short enough for the
+    // single-lookup decoder
+    for (int streams : { 1, 4, 8 }) {
+        CanonicalEncodedData canonical = compressCanonical(view, 11, streams);
+        CanonicalEncodedData canonicalCopy;
+        runBenchmark(results, "decompress/canonical/streams:" + integerToString(streams), corpus, size, minSeconds, [&]() {
+            canonicalCopy = canonical;
+        }, [&]() {
+            decompress(canonicalCopy);
+        });
+    }
+
+    // Single-pass adaptive coding
+    string adaptive;
+    runBenchmark(results, "compressAdaptive", corpus, size, minSeconds, nothing, [&]() {
+        adaptive = compressAdaptive(view);
+    });
+    runBenchmark(results, "decompressAdaptive", corpus, size, minSeconds, nothing, [&]() {
+        decompressAdaptive(adaptive);
+    });
+
+    string split;
+    runBenchmark(results, "compressSplit", corpus, size, minSeconds, nothing, [&]() {
+        split = compressSplit(view);
+    });
+    runBenchmark(results, "decompressSplit", corpus, size, minSeconds, nothing, [&]() {
+        decompressSplit(split);
+    });
+
+    Order1EncodedData order1;
+    runBenchmark(results, "compressOrder1", corpus, size, minSeconds, nothing, [&]() {
+        order1 = compressOrder1(view);
+    });
+    Order1EncodedData order1Copy;
+    runBenchmark(results, "decompress/order1", corpus, size, minSeconds, [&]() {
+        order1Copy = order1;
+    }, [&]() {
+        decompress(order1Copy);
+    });
+
+    // The text as 200-byte records, each coded with a table trained on samples of the corpus or
+    // with a tree of its own
+    Vector<string> samples;
+    string sampleText = benchmarkCorpus(corpus, 50 * 1000);
+    for (size_t offset = 0; offset < sampleText.size(); offset += 1000) {
+        samples.add(sampleText.substr(offset, 1000));
+    }
+    HuffmanTable table = trainTable(samples, 1);
+    Vector<string> records;
+    runBenchmark(results, "compressWithTable/records:200", corpus, size, minSeconds, [&]() {
+        records.clear();
+    }, [&]() {
+        for (size_t offset = 0; offset < size; offset += 200) {
+            records.add(compressWithTable(view.substr(offset, 200), table));
+        }
+    });
+    runBenchmark(results, "decompressWithTable/records:200", corpus, size, minSeconds, nothing, [&]() {
+        for (const string& record : records) {
+            decompressWithTable(record, table);
+        }
+    });
+    runBenchmark(results, "compressPacked/records:200", corpus, size, minSeconds, nothing, [&]() {
+        for (size_t offset = 0; offset < size; offset += 200) {
+            compressPacked(view.substr(offset, 200));
+        }
+    });
+
+    // Block-parallel compression from one thread up to every core
+    int cores = max(1, (int) thread::hardware_concurrency());
+    for (int threads = 1; threads <= cores; threads *= 2) {
+        string parallel;
+        string suffix = "/threads:" + integerToString(threads);
+        runBenchmark(results, "compressParallel" + suffix, corpus, size, minSeconds, nothing, [&]() {
+            parallel = compressParallel(view, threads);
+        });
+        runBenchmark(results, "decompressParallel" + suffix, corpus, size, minSeconds, nothing, [&]() {
+            decompressParallel(parallel, threads);
+        });
+    }
+
+    PackedEncodedData packed;
+    runBenchmark(results, "compress/packed", corpus, size, minSeconds, nothing, [&]() {
+        packed = compressPacked(text);
+    });
+
+    PackedEncodedData packedCopy;
+    runBenchmark(results, "decompress/packed", corpus, size, minSeconds, [&]() {
+        packedCopy = packed;
+    }, [&]() {
+        decompress(packedCopy);
+    });
+
+    if (size <= QUEUE_BENCHMARK_MAX) {
+        Queue<Bit> queueBits;
+        runBenchmark(results, "encodeText", corpus, size, minSeconds, nothing, [&]() {
+            queueBits = encodeText(tree, view);
+        });
+
+        Queue<Bit> queueCopy;
+        runBenchmark(results, "decodeText", corpus, size, minSeconds, [&]() {
+            queueCopy = queueBits;
+        }, [&]() {
+            decodeText(tree, queueCopy);
+        });
+
+        // The original bit-at-a-time decoder the table decoder replaced
+        runBenchmark(results, "decodeText/treeWalk", corpus, size, minSeconds, [&]() {
+            queueCopy = queueBits;
+        }, [&]() {
+            decodeTextByTreeWalk(tree, queueCopy);
+        });
+
+        EncodedData data;
+        runBenchmark(results, "compress", corpus, size, minSeconds, nothing, [&]() {
+            data = compress(view);
+        });
+
+        EncodedData dataCopy;
+        runBenchmark(results, "decompress", corpus, size, minSeconds, [&]() {
+            dataCopy = data;
+        }, [&]() {
+            decompress(dataCopy);
+        });
+    }
+    deallocateTree(tree);
+}
+
+/* Writes results as CSV, one row per benchmark.
+ */
+void writeBenchmarkCsv(ostream& out, const Vector<BenchmarkResult>& results) {
+    out << "name,corpus,bytes,iterations,ns_per_op,mb_per_s" << endl;
+    for (const BenchmarkResult& result : results) {
+        double perRun = result.seconds / result.iterations;
+        out << result.name << "," << result.corpus << "," << result.bytes << "," << result.iterations << ","
+            << fixed << setprecision(0) << perRun * 1e9 << ","
+            << setprecision(2) << result.bytes / (1024.0 * 1024.0) / perRun << endl;
+    }
+}
+
+/* Writes results as JSON in the layout of Google Benchmark's --benchmark_format=json.
+ */
+void writeBenchmarkJson(ostream& out, const Vector<BenchmarkResult>& results) {
+    out << "{" << endl << "  \"benchmarks\": [" << endl;
+    for (int i = 0; i < results.size(); i++) {
+        const BenchmarkResult& result = results[i];
+        double perRun = result.seconds / result.iterations;
+        out << "    {\"name\": \"" << result.name << "/" << result.corpus << "/" << result.bytes << "\", "
+            << "\"corpus\": \"" << result.corpus << "\", \"bytes\": " << result.bytes << ", "
+            << "\"iterations\": " << result.iterations << ", "
+            << "\"real_time\": " << fixed << setprecision(0) << perRun * 1e9 << ", \"time_unit\": \"ns\", "
+            << "\"bytes_per_second\": " << result.bytes / perRun << "}"
+            << (i + 1 < results.size() ? "," : "") << endl;
+    }
+    out << "  ]" << endl << "}" << endl;
+}
+
+/* The benchmark runner, built in place of the test runner when HUFFMAN_BENCHMARK is defined, with
+ * the build line given before the huff tool. It runs every benchmark over each corpus at sizes
+ * from 1 KB up to --max-size (default 16 MB, at most 256 MB) and writes the results to standard
+ * output:
+ *
+ *     huff_benchmark [--format=csv|json] [--max-size=BYTES] [--min-time=SECONDS]
+ */
+int main(int argc, char* argv[]) {
+    string format = "csv";
+    size_t maxSize = 1 << 24;
+    double minSeconds = 0.1;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (startsWith(arg, "--format=")) {
+            format = arg.substr(9);
+        } else if (startsWith(arg, "--max-size=")) {
+            maxSize = stoull(arg.substr(11));
+        } else if (startsWith(arg, "--min-time=")) {
+            minSeconds = stod(arg.substr(11));
+        } else {
+            cerr << "usage: huff_benchmark [--format=csv|json] [--max-size=BYTES] [--min-time=SECONDS]" << endl;
+            return 2;
+        }
+    }
+    Vector<BenchmarkResult> results;
+    for (string corpus : { "english", "random", "skewed", "runs", "two-symbol" }) {
+        for (size_t size = 1 << 10; size <= min(maxSize, (size_t) 1 << 28); size *= 4) {
+            benchmarkCorpusText(results, corpus, benchmarkCorpus(corpus, size), minSeconds);
+        }
+    }
+    if (format == "json") {
+        writeBenchmarkJson(cout, results);
+    } else {
+        writeBenchmarkCsv(cout, results);
+    }
+    return 0;
+}
+
+#endif
+
+/* * * * * * Test Cases Below This Point * * * * * */
 
 STUDENT_TEST("areEqual check") {
     EncodingTreeNode* tree0 = createExampleTree();
@@ -362,6 +4345,1104 @@ STUDENT_TEST("decodeText, small example encoding tree") {
     deallocateTree(tree);
 }
 
+STUDENT_TEST("decodeText, table decoder agrees with tree walk on codes longer than the table") {
+    // Fibonacci frequencies give a maximally skewed tree with codes up to 13 bits long
+    string text = fibonacciText(14);
+    EncodingTreeNode* tree = buildHuffmanTree(text);
+    Queue<Bit> messageBits = encodeText(tree, text);
+    Queue<Bit> walkBits = messageBits;
+    EXPECT_EQUAL(decodeText(tree, messageBits), text);
+    EXPECT_EQUAL(decodeTextByTreeWalk(tree, walkBits), text);
+    deallocateTree(tree);
+}
+
+STUDENT_TEST("decodeText, a code deeper than the message left reports an error") {
+    // A chain 100 levels deep, whose deepest code is 99 ones, fed only 60 of them
+    EncodingTreeNode* tree = new EncodingTreeNode(new EncodingTreeNode('a'), new EncodingTreeNode('b'));
+    for (int depth = 0; depth < 98; depth++) {
+        tree = new EncodingTreeNode(new EncodingTreeNode((char) (depth + 'c')), tree);
+    }
+    BitBuffer messageBits;
+    for (int i = 0; i < 60; i++) {
+        messageBits.writeBit(1);
+    }
+    BitBuffer compactBits = messageBits;
+    EXPECT_ERROR(decodeText(tree, messageBits));
+    CompactTree compact;
+    compactTreeFrom(tree, compact);
+    EXPECT_ERROR(decodeText(compact, compactBits));
+    deallocateTree(tree);
+}
+
+STUDENT_TEST("decodeText, table decoder and tree walk round-trip English-like text") {
+    string text = generateText(20000, 106);
+    EncodingTreeNode* tree = buildHuffmanTree(text);
+    Queue<Bit> walkBits = encodeText(tree, text);
+    Queue<Bit> tableBits = walkBits;
+    EXPECT_EQUAL(decodeTextByTreeWalk(tree, walkBits), text);
+    EXPECT_EQUAL(decodeText(tree, tableBits), text);
+    deallocateTree(tree);
+}
+
+STUDENT_TEST("compress, reports an error on one repeated character instead of crashing") {
+    EXPECT_ERROR(compress("aaaa"));
+    EXPECT_ERROR(compress(string(10000, 'x')));
+    EncodedData data = compress("ab");
+    EXPECT_EQUAL(decompress(data), "ab");
+
+    // A flattened lone leaf has no codes, so decoding with it is an error too
+    EncodingTreeNode* leaf = new EncodingTreeNode('a');
+    Queue<Bit> messageBits = { 0, 0, 0 };
+    EXPECT_ERROR(decodeText(leaf, messageBits));
+    delete leaf;
+}
+
+STUDENT_TEST("BitBuffer, reads back mixed-width writes across word boundaries") {
+    BitBuffer bits;
+    for (int i = 0; i < 100; i++) {
+        bits.writeBits(i, 1 + i % 64);
+    }
+    EXPECT_EQUAL(bits.size(), 2746u);
+    for (int i = 0; i < 100; i++) {
+        uint64_t expected = (1 + i % 64) == 64 ? i : i & ((uint64_t(1) << (1 + i % 64)) - 1);
+        EXPECT_EQUAL(bits.readBits(1 + i % 64), expected);
+    }
+    EXPECT(bits.isEmpty());
+}
+
+STUDENT_TEST("BitBuffer, assign from an empty source leaves an empty buffer") {
+    BitBuffer bits;
+    bits.writeBits(5, 3);
+    bits.assign(nullptr, 0);
+    EXPECT(bits.isEmpty());
+    EXPECT_EQUAL(bits.size(), 0u);
+    bits.writeBits(1, 1);
+    EXPECT_EQUAL(bits.readBit(), 1);
+
+    // An empty order-1 message reaches assign with an empty vector's null data
+    Order1EncodedData data = compressOrder1("");
+    ostringstream out;
+    writeOrder1Data(out, data);
+    istringstream in(out.str());
+    Order1EncodedData readBack;
+    readOrder1Data(in, readBack);
+    EXPECT_EQUAL(decompress(readBack), "");
+}
+
+STUDENT_TEST("BitBuffer, packBits and unpackBits round-trip a queue") {
+    Queue<Bit> queue = { 1, 0, 1, 0, 1, 0, 0, 1, 1, 1, 1, 0, 0, 1, 1, 1, 0, 1, 0 };
+    Queue<Bit> copy = queue;
+    BitBuffer packed = packBits(copy);
+    EXPECT(copy.isEmpty());
+    EXPECT_EQUAL(packed.size(), 19u);
+    EXPECT_EQUAL(unpackBits(packed), queue);
+}
+
+STUDENT_TEST("compressPacked, matches compress bit for bit and round-trips") {
+    EncodedData data = compress("STREETTEST");
+    PackedEncodedData packed = compressPacked("STREETTEST");
+    EXPECT_EQUAL(unpackBits(packed.treeShape), data.treeShape);
+    EXPECT_EQUAL(packed.treeLeaves, "TRSE");
+    EXPECT_EQUAL(unpackBits(packed.messageBits), data.messageBits);
+
+    Vector<string> inputs = { "HAPPY HIP HOP", "STREETTEST", generateText(100000, 2) };
+    for (string input : inputs) {
+        PackedEncodedData roundTrip = compressPacked(input);
+        EXPECT_EQUAL(decompress(roundTrip), input);
+    }
+}
+
+STUDENT_TEST("compressPacked, reports an error on one repeated character instead of crashing") {
+    EXPECT_ERROR(compressPacked("aaaa"));
+    EXPECT_ERROR(compressPacked(string(10000, 'x')));
+
+    // A packed lone leaf, as a corrupt file could hold, is rejected by decompress
+    PackedEncodedData data;
+    data.treeShape.writeBit(0);
+    data.treeLeaves = "a";
+    data.messageBits.writeBits(0, 4);
+    data.symbolCount = 4;
+    EXPECT_ERROR(decompress(data));
+    char out[4];
+    PackedEncodedData copy;
+    copy.treeShape.writeBit(0);
+    copy.treeLeaves = "a";
+    EXPECT_ERROR(decompress(copy, out, sizeof(out)));
+}
+
+STUDENT_TEST("compressPacked, message bits use one bit of memory per bit") {
+    string text = generateText(1024 * 1024, 3);
+    PackedEncodedData data = compressPacked(text);
+    // Within a word's rounding and the vector's growth slack of size / 8 bytes
+    EXPECT(data.messageBits.memoryUsage() <= data.messageBits.size() / 8 * 2 + 64);
+    EXPECT_EQUAL(decompress(data), text);
+}
+
+STUDENT_TEST("compressCanonical, header and codes for small example") {
+    CanonicalEncodedData data = compressCanonical("STREETTEST");
+    // T is 1 bit, E is 2 bits, R and S are 3 bits, as in the example tree
+    EXPECT_EQUAL(data.symbols, "TERS");
+    Vector<int> lengthCounts = { 0, 1, 1, 2 };
+    EXPECT_EQUAL(data.lengthCounts, lengthCounts);
+    // S=111 T=0 R=110 E=10 E=10 T=0 T=0 E=10 S=111 T=0
+    Queue<Bit> messageBits = { 1, 1, 1, 0, 1, 1, 0, 1, 0, 1, 0, 0, 0, 1, 0, 1, 1, 1, 0 };
+    EXPECT_EQUAL(unpackBits(data.messageBits), messageBits);
+}
+
+STUDENT_TEST("compressCanonical, round-trips short, long-code and large inputs") {
+    string fibonacci = fibonacciText(14);
+    Vector<string> inputs = { "HAPPY HIP HOP", "aa", fibonacci, generateText(200000, 4) };
+    for (string input : inputs) {
+        CanonicalEncodedData data = compressCanonical(input);
+        EXPECT_EQUAL(decompress(data), input);
+    }
+    EXPECT_ERROR(compressCanonical("a"));
+}
+
+STUDENT_TEST("countFrequencies, interleaved histogram matches a map count") {
+    Vector<string> inputs = { "STREETTEST", string(10000, 'x'), generateText(100003, 5) };
+    string binary = "";
+    for (int i = 0; i < 70000; i++) {
+        binary += (char) ((i * 7919) % 256);
+    }
+    inputs.add(binary);
+    for (string input : inputs) {
+        Map<char, int> letterMap;
+        for (char letter : input) {
+            letterMap[letter]++;
+        }
+        uint64_t counts[256] = { 0 };
+        countFrequencies(reinterpret_cast<const uint8_t*>(input.data()), input.size(), counts);
+        for (int symbol = 0; symbol < 256; symbol++) {
+            EXPECT_EQUAL(counts[symbol], (uint64_t) letterMap.get((char) symbol));
+        }
+    }
+}
+
+STUDENT_TEST("countFrequencies, histogram matches a map count on English-like text") {
+    string text = generateText(100000, 7);
+    uint64_t counts[256] = { 0 };
+    countFrequencies(reinterpret_cast<const uint8_t*>(text.data()), text.size(), counts);
+    Map<char, int> letterMap;
+    for (char letter : text) letterMap[letter]++;
+    for (char letter : letterMap) {
+        EXPECT_EQUAL(counts[(uint8_t) letter], (uint64_t) letterMap[letter]);
+    }
+}
+
+STUDENT_TEST("countFrequencies, every histogram kernel matches a simple count") {
+    string mixed = generateText(50021, 37);
+    setRandomSeed(38);
+    string runs = "";
+    while (runs.size() < 60000) {
+        runs += string(randomInteger(1, 100), (char) randomInteger(0, 255));
+    }
+    string binary = "";
+    for (int i = 0; i < 40000; i++) {
+        binary += (char) randomInteger(0, 255);
+    }
+    for (NamedHistogramKernel named : availableHistogramKernels()) {
+        for (string input : { mixed, runs, binary }) {
+            for (size_t offset = 0; offset < 40; offset += 13) {
+                const uint8_t* bytes = reinterpret_cast<const uint8_t*>(input.data()) + offset;
+                size_t length = input.size() - offset - randomInteger(0, 31);
+                uint64_t expected[256] = { 0 };
+                for (size_t i = 0; i < length; i++) {
+                    expected[bytes[i]]++;
+                }
+                uint64_t counts[256] = { 0 };
+                countFrequenciesWith(named.kernel, bytes, length, counts);
+                EXPECT(memcmp(counts, expected, sizeof(counts)) == 0);
+            }
+        }
+    }
+    // Mixed bytes are counted with the scalar kernel, long runs with the best vector kernel there is
+    const uint8_t* mixedBytes = reinterpret_cast<const uint8_t*>(mixed.data());
+    EXPECT_EQUAL(selectHistogramKernel(mixedBytes, mixed.size()).name, "scalar");
+    string longRuns = "";
+    for (int run = 0; run < 100; run++) {
+        longRuns += string(300, (char) (run % 5));
+    }
+    string expected = "scalar";
+#ifdef HUFFMAN_X86_HISTOGRAMS
+    if (__builtin_cpu_supports("sse2")) expected = "sse2";
+    if (__builtin_cpu_supports("avx2")) expected = "avx2";
+#endif
+#ifdef HUFFMAN_NEON_HISTOGRAMS
+    expected = "neon";
+#endif
+    const uint8_t* runBytes = reinterpret_cast<const uint8_t*>(longRuns.data());
+    EXPECT_EQUAL(selectHistogramKernel(runBytes, longRuns.size()).name, expected);
+    uint64_t counts[256] = { 0 };
+    countFrequencies(runBytes, longRuns.size(), counts);
+    EXPECT_EQUAL(counts[0], 20 * 300);
+    EXPECT_EQUAL(counts[4], 20 * 300);
+}
+
+STUDENT_TEST("BitReader, reads the same bits as a BitBuffer at any starting position") {
+    setRandomSeed(40);
+    BitBuffer buffer;
+    Vector<int> counts;
+    Vector<uint64_t> values;
+    for (int i = 0; i < 2000; i++) {
+        int count = randomInteger(1, BIT_READER_REFILL_BITS);
+        uint64_t random = (uint64_t) randomInteger(0, (1 << 30) - 1) << 30 | randomInteger(0, (1 << 30) - 1);
+        uint64_t value = random & (~0ULL >> (64 - count));
+        buffer.writeBits(value, count);
+        counts.add(count);
+        values.add(value);
+    }
+    BitReader reader(buffer);
+    for (int i = 0; i < counts.size(); i++) {
+        EXPECT_EQUAL(reader.readBits(counts[i]), values[i]);
+    }
+    EXPECT(reader.isEmpty());
+    EXPECT_EQUAL(reader.position(), buffer.size());
+
+    // Starting part way through, a refill then covers peeks without further loads
+    for (int start = 0; start < 64; start += 5) {
+        BitReader offsetReader(buffer.bytes(), buffer.size(), start);
+        EXPECT(offsetReader.bitsAvailable() >= BIT_READER_REFILL_BITS);
+        EXPECT_EQUAL(offsetReader.peek(BIT_READER_REFILL_BITS), buffer.peekAt(start, BIT_READER_REFILL_BITS));
+        offsetReader.consume(23);
+        EXPECT_EQUAL(offsetReader.peek(20), buffer.peekAt(start + 23, 20));
+        EXPECT_EQUAL(offsetReader.remaining(), buffer.size() - start - 23);
+    }
+}
+
+STUDENT_TEST("unflattenTree, consumes only the tree's own bits and leaves from the queues") {
+    EncodingTreeNode* reference = createExampleTree();
+    Queue<Bit> treeShape;
+    Queue<char> treeLeaves;
+    flattenTree(reference, treeShape, treeLeaves);
+    treeShape.enqueue(1);
+    treeShape.enqueue(0);
+    treeLeaves.enqueue('Z');
+    EncodingTreeNode* tree = unflattenTree(treeShape, treeLeaves);
+    Queue<Bit> shape, referenceShape;
+    Queue<char> leaves, referenceLeaves;
+    flattenTree(tree, shape, leaves);
+    flattenTree(reference, referenceShape, referenceLeaves);
+    EXPECT_EQUAL(shape, referenceShape);
+    EXPECT_EQUAL(leaves, referenceLeaves);
+    Queue<Bit> restShape = { 1, 0 };
+    Queue<char> restLeaves = { 'Z' };
+    EXPECT_EQUAL(treeShape, restShape);
+    EXPECT_EQUAL(treeLeaves, restLeaves);
+    deallocateTree(tree);
+    deallocateTree(reference);
+
+    Queue<Bit> emptyShape;
+    Queue<char> emptyLeaves;
+    EXPECT(unflattenTree(emptyShape, emptyLeaves) == nullptr);
+}
+
+STUDENT_TEST("BitWriter, writes the same bits as BitBuffer::writeBits and only on flush") {
+    setRandomSeed(41);
+    for (int start : { 0, 3, 64, 101 }) {
+        BitBuffer expected, written;
+        expected.writeBits(0, start % 64 + 1);
+        written.writeBits(0, start % 64 + 1);
+        BitWriter writer(written);
+        // An empty write, with no bits pending in the container, adds nothing
+        writer.writeBits(0, 0);
+        for (int i = 0; i < 500; i++) {
+            int count = randomInteger(0, 64);
+            uint64_t random = (uint64_t) randomInteger(0, (1 << 30) - 1) << 34 ^ randomInteger(0, (1 << 30) - 1);
+            uint64_t value = count == 0 ? 0 : random & (~0ULL >> (64 - count));
+            expected.writeBits(value, count);
+            writer.writeBits(value, count);
+        }
+        EXPECT(written.size() < expected.size());
+        writer.flush();
+        EXPECT_EQUAL(written.size(), expected.size());
+        EXPECT(memcmp(written.bytes(), expected.bytes(), (expected.size() + 7) / 8) == 0);
+    }
+}
+
+STUDENT_TEST("encodeWithCodes, stores the same bits as writeBits for every group size and start") {
+    setRandomSeed(43);
+    string text(ENCODE_CHUNK + 1001, '\0');
+    for (char& ch : text) {
+        ch = (char) randomInteger(0, 255);
+    }
+    // Longest codes giving 4, 3, 2 and 1 codes per store, then past encodeInto's limit
+    for (int longest : { 14, 18, 28, 32, 40, 64 }) {
+        SymbolCode codes[256];
+        for (int symbol = 0; symbol < 256; symbol++) {
+            int length = symbol % longest + 1;
+            uint64_t random = (uint64_t) randomInteger(0, (1 << 30) - 1) << 34 ^ randomInteger(0, (1 << 30) - 1);
+            codes[symbol] = { random & (~0ULL >> (64 - length)), length };
+        }
+        for (int start : { 0, 5, 64, 101 }) {
+            BitBuffer expected, encoded;
+            expected.writeBits(0, start % 64 + 1);
+            encoded.writeBits(0, start % 64 + 1);
+            for (char ch : text) {
+                expected.writeBits(codes[(uint8_t) ch].bits, codes[(uint8_t) ch].length);
+            }
+            encodeWithCodes(codes, reinterpret_cast<const uint8_t*>(text.data()), text.size(), encoded);
+            EXPECT_EQUAL(encoded.size(), expected.size());
+            EXPECT(memcmp(encoded.bytes(), expected.bytes(), (expected.size() + 7) / 8 + 8) == 0);
+        }
+    }
+}
+
+STUDENT_TEST("encodeText and flattenTree, queue forms match the packed forms bit for bit") {
+    string text = generateText(20000, 42);
+    EncodingTreeNode* tree = buildHuffmanTree(text);
+    BitBuffer packedBits, packedShape;
+    string packedLeaves = "";
+    encodeText(tree, text, packedBits);
+    flattenTree(tree, packedShape, packedLeaves);
+    Queue<Bit> messageBits = encodeText(tree, text);
+    Queue<Bit> treeShape;
+    Queue<char> treeLeaves;
+    flattenTree(tree, treeShape, treeLeaves);
+    EXPECT_EQUAL(messageBits, unpackBits(packedBits));
+    EXPECT_EQUAL(treeShape, unpackBits(packedShape));
+    EXPECT_EQUAL(treeLeaves.size(), (int) packedLeaves.size());
+    for (char leaf : packedLeaves) {
+        EXPECT_EQUAL(treeLeaves.dequeue(), leaf);
+    }
+    deallocateTree(tree);
+}
+
+STUDENT_TEST("buildHuffmanTree, builds the same tree as the original over alphabet sizes 2 to 256") {
+    for (int alphabetSize = 2; alphabetSize <= 256; alphabetSize *= 2) {
+        string text = textWithAlphabet(alphabetSize);
+        EncodingTreeNode* tree = buildHuffmanTree(text);
+        EncodingTreeNode* reference = buildHuffmanTreeByTextFrequency(text);
+        Queue<Bit> shape, referenceShape;
+        Queue<char> leaves, referenceLeaves;
+        flattenTree(tree, shape, leaves);
+        flattenTree(reference, referenceShape, referenceLeaves);
+        EXPECT_EQUAL(shape, referenceShape);
+        EXPECT_EQUAL(leaves, referenceLeaves);
+        deallocateTree(tree);
+        deallocateTree(reference);
+    }
+}
+
+STUDENT_TEST("buildHuffmanTreeTwoQueue, same tree as buildHuffmanTree for small example") {
+    EncodingTreeNode* reference = createExampleTree();
+    EncodingTreeNode* tree = buildHuffmanTreeTwoQueue("STREETTEST");
+    Queue<Bit> referenceShape, treeShape;
+    Queue<char> referenceLeaves, treeLeaves;
+    flattenTree(reference, referenceShape, referenceLeaves);
+    flattenTree(tree, treeShape, treeLeaves);
+    EXPECT_EQUAL(treeShape, referenceShape);
+    EXPECT_EQUAL(treeLeaves, referenceLeaves);
+    deallocateTree(reference);
+    deallocateTree(tree);
+}
+
+STUDENT_TEST("buildHuffmanTreeTwoQueue, same cost as buildHuffmanTree") {
+    Vector<string> inputs = { "HAPPY HIP HOP", "Nana Nana Nana Nana Batman", generateText(50000, 8) };
+    for (int alphabetSize = 2; alphabetSize <= 256; alphabetSize *= 2) {
+        inputs.add(textWithAlphabet(alphabetSize));
+    }
+    for (string input : inputs) {
+        EncodingTreeNode* heapTree = buildHuffmanTree(input);
+        EncodingTreeNode* queueTree = buildHuffmanTreeTwoQueue(input);
+        EXPECT_EQUAL(encodedCost(queueTree, input), encodedCost(heapTree, input));
+        deallocateTree(heapTree);
+        deallocateTree(queueTree);
+    }
+    EXPECT_ERROR(buildHuffmanTreeTwoQueue("aaaa"));
+}
+
+STUDENT_TEST("compressCanonical, code length limit caps codes and round-trips") {
+    string fibonacci = fibonacciText(14);
+    Vector<string> inputs = { fibonacci, generateText(100000, 9), textWithAlphabet(256) };
+    for (string input : inputs) {
+        CanonicalEncodedData unlimited = compressCanonical(input);
+        for (int limit = 8; limit <= 15; limit++) {
+            CanonicalEncodedData data = compressCanonical(input, limit);
+            EXPECT_EQUAL(data.maxCodeLength, limit);
+            EXPECT(data.lengthCounts.size() - 1 <= limit);
+            // Limiting can only cost bits, and costs none once the limit is above the longest code
+            EXPECT(data.messageBits.size() >= unlimited.messageBits.size());
+            if (unlimited.lengthCounts.size() - 1 <= limit) {
+                EXPECT_EQUAL(data.messageBits.size(), unlimited.messageBits.size());
+            }
+            EXPECT_EQUAL(decompress(data), input);
+        }
+    }
+    EXPECT_ERROR(compressCanonical(textWithAlphabet(256), 7));
+}
+
+STUDENT_TEST("encodeText, table encoder round-trips English-like text") {
+    string text = generateText(100000, 10);
+    EncodingTreeNode* tree = buildHuffmanTree(text);
+    BitBuffer messageBits;
+    encodeText(tree, text, messageBits);
+    EXPECT_EQUAL(decodeText(tree, messageBits), text);
+    deallocateTree(tree);
+}
+
+STUDENT_TEST("compressStream, round-trips across block boundaries") {
+    Vector<string> inputs = { "", "x", "HAPPY HIP HOP", generateText(10001, 11), generateText(10000, 12) + "!" };
+    for (string input : inputs) {
+        for (int limit : { 0, 12 }) {
+            istringstream in(input);
+            ostringstream compressed;
+            compressStream(in, compressed, 1000, limit);
+            istringstream compressedIn(compressed.str());
+            ostringstream out;
+            decompressStream(compressedIn, out);
+            EXPECT_EQUAL(out.str(), input);
+        }
+    }
+    istringstream in("HAPPY HIP HOP");
+    ostringstream compressed;
+    EXPECT_ERROR(compressStream(in, compressed, 0));
+}
+
+STUDENT_TEST("decompressStream, reports errors on bad input") {
+    istringstream notCompressed("HAPPY HIP HOP");
+    ostringstream out;
+    EXPECT_ERROR(decompressStream(notCompressed, out));
+
+    istringstream in(generateText(5000, 13));
+    ostringstream compressed;
+    compressStream(in, compressed, 1000);
+    string truncated = compressed.str().substr(0, compressed.str().size() / 2);
+    istringstream truncatedIn(truncated);
+    EXPECT_ERROR(decompressStream(truncatedIn, out));
+
+    // A bit count longer than the symbols' longest codes is rejected before it is allocated
+    CanonicalEncodedData data = compressCanonical("HAPPY HIP HOP", 3);
+    uint64_t longest = data.lengthCounts.size() - 1;
+    for (uint64_t bitCount : { data.symbolCount * longest + 1, ~(uint64_t) 0 }) {
+        ostringstream forged;
+        writeCanonicalHeader(forged, data);
+        writeBigEndian(forged, bitCount, 8);
+        forged << string(8, '\0');
+        istringstream forgedIn(forged.str());
+        CanonicalEncodedData readBack;
+        EXPECT_ERROR(readCanonicalData(forgedIn, readBack));
+    }
+
+    // Through decompressStream a forged symbol count cannot vouch for a huge bit count, and a
+    // bit count that fits a huge block length fails when the input runs out, not in bad_alloc
+    uint64_t huge = (uint64_t) 1 << 40;
+    struct ForgedBlock { uint64_t length; uint64_t symbolCount; uint64_t bitCount; };
+    for (ForgedBlock block : { ForgedBlock { 13, 13, huge }, ForgedBlock { 13, huge, huge },
+                               ForgedBlock { 0xFFFFFFFF, 0xFFFFFFFF, 63 * (uint64_t) 0xFFFFFFFF },
+                               ForgedBlock { 0xFFFFFFFF, 0xFFFFFFFF, 0 } }) {
+        ostringstream forged;
+        forged.write(STREAM_MAGIC, sizeof(STREAM_MAGIC));
+        writeBigEndian(forged, STREAM_VERSION, 1);
+        writeBigEndian(forged, block.length, 4);
+        data.symbolCount = block.symbolCount;
+        writeCanonicalHeader(forged, data);
+        writeBigEndian(forged, block.bitCount, 8);
+        forged << string(8, '\0');
+        istringstream forgedIn(forged.str());
+        EXPECT_ERROR(decompressStream(forgedIn, out));
+    }
+}
+
+STUDENT_TEST("compressParallel, round-trips with any thread and block count") {
+    Vector<string> inputs = { "", "x", "HAPPY HIP HOP", generateText(100001, 14) };
+    for (string input : inputs) {
+        for (int threads : { 1, 3, 8 }) {
+            string compressed = compressParallel(input, threads, 4096);
+            EXPECT_EQUAL(decompressParallel(compressed, threads), input);
+            EXPECT_EQUAL(decompressParallel(compressed, 1), input);
+        }
+    }
+    EXPECT_ERROR(decompressParallel("HAPPY HIP HOP", 2));
+    EXPECT_ERROR(compressParallel("HAPPY HIP HOP", 2, 0));
+
+    // A forged index is rejected before anything is allocated from it
+    string compressed = compressParallel(generateText(10000, 45), 2, 4096);
+    string hugeCount = compressed;
+    hugeCount.replace(5, 4, "\xFF\xFF\xFF\xFF");
+    EXPECT_ERROR(decompressParallel(hugeCount, 2));
+    string hugeRaw = compressed;
+    hugeRaw[9] = '\x7F';  // the high byte of the first block's raw length
+    EXPECT_ERROR(decompressParallel(hugeRaw, 2));
+    string hugeBlock = compressed;
+    hugeBlock[17] = '\x7F';  // the high byte of the first block's compressed length
+    EXPECT_ERROR(decompressParallel(hugeBlock, 2));
+
+    // So is a block bit count that its codes allow but its indexed length cannot hold
+    size_t firstBlock = 4 + 1 + 4 + 16 * 3;
+    istringstream headerIn(compressed.substr(firstBlock));
+    CanonicalEncodedData header;
+    readCanonicalHeader(headerIn, header);
+    ostringstream bitCount;
+    writeBigEndian(bitCount, header.symbolCount * (header.lengthCounts.size() - 1), 8);
+    string hugeBits = compressed;
+    hugeBits.replace(firstBlock + headerIn.tellg(), 8, bitCount.str());
+    EXPECT_ERROR(decompressParallel(hugeBits, 2));
+}
+
+STUDENT_TEST("compressParallel, every thread count up to the cores writes the same blocks") {
+    string text = generateText(200000, 15);
+    string oneThread = compressParallel(text, 1, 16384);
+    int cores = max(1, (int) thread::hardware_concurrency());
+    for (int threads = 1; threads <= max(cores, 4); threads *= 2) {
+        EXPECT_EQUAL(compressParallel(text, threads, 16384), oneThread);
+        EXPECT_EQUAL(decompressParallel(oneThread, threads), text);
+    }
+}
+
+STUDENT_TEST("compressCanonical, interleaved streams round-trip in memory and serialized") {
+    Vector<string> inputs = { "ab", "HAPPY HIP HOP", generateText(10007, 16) };
+    for (string input : inputs) {
+        for (int streams = 1; streams <= MAX_STREAMS; streams++) {
+            for (int limit : { 0, 11 }) {
+                CanonicalEncodedData data = compressCanonical(input, limit, streams);
+                ostringstream out;
+                writeCanonicalData(out, data);
+                EXPECT_EQUAL(decompress(data), input);
+                istringstream in(out.str());
+                CanonicalEncodedData readBack;
+                readCanonicalData(in, readBack);
+                EXPECT_EQUAL(readBack.streamCount, streams);
+                EXPECT_EQUAL(decompress(readBack), input);
+            }
+        }
+    }
+    EXPECT_ERROR(compressCanonical("HAPPY HIP HOP", 0, MAX_STREAMS + 1));
+}
+
+STUDENT_TEST("compressCanonical, 1, 4 and 8 interleaved streams decode the same text") {
+    string text = generateText(100000, 17);
+    for (int streams : { 1, 4, 8 }) {
+        CanonicalEncodedData data = compressCanonical(text, 11, streams);
+        EXPECT_EQUAL(data.streamStarts.size(), streams - 1);
+        EXPECT_EQUAL(decompress(data), text);
+    }
+}
+
+STUDENT_TEST("TreeArena, arena-built trees match heap-built trees") {
+    TreeArena arena;
+    Vector<string> inputs = { "STREETTEST", "HAPPY HIP HOP", textWithAlphabet(256) };
+    for (string input : inputs) {
+        arena.clear();
+        EncodingTreeNode* heapTree = buildHuffmanTree(input);
+        EncodingTreeNode* arenaTree = buildHuffmanTree(input, arena);
+        Queue<Bit> heapShape, arenaShape;
+        Queue<char> heapLeaves, arenaLeaves;
+        flattenTree(heapTree, heapShape, heapLeaves);
+        flattenTree(arenaTree, arenaShape, arenaLeaves);
+        EXPECT_EQUAL(arenaShape, heapShape);
+        EXPECT_EQUAL(arenaLeaves, heapLeaves);
+        deallocateTree(heapTree);
+
+        TreeArena unflattenArena;
+        EncodingTreeNode* unflattened = unflattenTree(arenaShape, arenaLeaves, unflattenArena);
+        EXPECT_EQUAL(unflattenArena.size(), arena.size());
+        Queue<Bit> messageBits = encodeText(unflattened, input);
+        EXPECT_EQUAL(decodeText(arenaTree, messageBits), input);
+    }
+    arena.clear();
+    EncodingTreeNode* example = createExampleTree(arena);
+    EXPECT_EQUAL(arena.size(), 7);
+    EXPECT_EQUAL(encodeText(example, "SET"), Queue<Bit>({ 1, 0, 1, 1, 1, 0 }));
+
+    TreeArena tiny(3);
+    EXPECT_NO_ERROR(buildHuffmanTree("ab", tiny));
+    EXPECT_ERROR(buildHuffmanTree("abc", tiny));
+
+    // Arenas own their nodes, so they are neither copied nor made from a bare int
+    EXPECT(!is_copy_constructible<TreeArena>::value && !is_copy_assignable<TreeArena>::value);
+    EXPECT(!(is_convertible<int, TreeArena>::value));
+}
+
+STUDENT_TEST("TreeArena, trees rebuilt in a cleared arena still round-trip") {
+    string text = generateText(200, 18);
+    TreeArena arena;
+    for (int i = 0; i < 100; i++) {
+        arena.clear();
+        EncodingTreeNode* tree = buildHuffmanTree(text, arena);
+        BitBuffer messageBits;
+        encodeText(tree, text, messageBits);
+        EXPECT_EQUAL(decodeText(tree, messageBits), text);
+    }
+}
+
+STUDENT_TEST("CompactTree, built from buildHuffmanTree and unflattenTree, round-trips") {
+    string fibonacci = fibonacciText(14);
+    Vector<string> inputs = { "STREETTEST", fibonacci, textWithAlphabet(256), generateText(100000, 19) };
+    for (string input : inputs) {
+        EncodingTreeNode* tree = buildHuffmanTree(input);
+        CompactTree fromTree;
+        compactTreeFrom(tree, fromTree);
+        BitBuffer treeShape;
+        string treeLeaves;
+        flattenTree(tree, treeShape, treeLeaves);
+        CompactTree fromFlat;
+        unflattenTree(treeShape, treeLeaves, fromFlat);
+        EXPECT_EQUAL((size_t) fromFlat.nodeCount, treeLeaves.size() - 1);
+
+        BitBuffer nodeBits, compactBits;
+        encodeText(tree, input, nodeBits);
+        encodeText(fromTree, input, compactBits);
+        EXPECT_EQUAL(compactBits.size(), nodeBits.size());
+        EXPECT_EQUAL(decodeText(fromFlat, compactBits), input);
+
+        // A shape with more leaves than treeLeaves holds is reported, not read past the string
+        BitBuffer shortShape;
+        shortShape.assign(treeShape.bytes(), treeShape.size());
+        CompactTree fromShort;
+        EXPECT_ERROR(unflattenTree(shortShape, treeLeaves.substr(0, treeLeaves.size() - 1), fromShort));
+        deallocateTree(tree);
+    }
+    EXPECT(sizeof(CompactTree) <= 1024 + sizeof(int));
+}
+
+STUDENT_TEST("compressFile, round-trips files of both kinds through mapped files") {
+    string binary = "";
+    for (int i = 0; i < 5000; i++) {
+        binary += (char) ((i * i) % 256);
+    }
+    Vector<string> inputs = { "", "a", "aaaa", string(1000, '\xFF'), "STREETTEST", binary, generateText(300000, 20) };
+    for (string input : inputs) {
+        for (int kind : { FILE_KIND_CANONICAL, FILE_KIND_TREE }) {
+            ofstream("huffman-test.in", ios::binary) << input;
+            compressFile("huffman-test.in", "huffman-test.huf", kind);
+            decompressFile("huffman-test.huf", "huffman-test.out");
+            ifstream in("huffman-test.out", ios::binary);
+            string output((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+            EXPECT_EQUAL(output, input);
+        }
+    }
+    ofstream("huffman-test.in", ios::binary) << generateText(100000, 21);
+    compressFile("huffman-test.in", "huffman-test.huf", FILE_KIND_CANONICAL, 11, 4);
+    decompressFile("huffman-test.huf", "huffman-test.out");
+    EXPECT_EQUAL(crc32(MappedFile("huffman-test.out").data(), 100000), crc32(MappedFile("huffman-test.in").data(), 100000));
+
+    // Asked for them, each side records its phases in order
+    Vector<PhaseTime> compressPhases, decompressPhases;
+    compressFile("huffman-test.in", "huffman-test.huf", FILE_KIND_CANONICAL, 0, 1, &compressPhases);
+    decompressFile("huffman-test.huf", "huffman-test.out", &decompressPhases);
+    Vector<string> compressNames, decompressNames;
+    for (const PhaseTime& phase : compressPhases) compressNames.add(phase.phase);
+    for (const PhaseTime& phase : decompressPhases) decompressNames.add(phase.phase);
+    EXPECT_EQUAL(compressNames, Vector<string>({ "checksum", "histogram", "code build", "encode" }));
+    EXPECT_EQUAL(decompressNames, Vector<string>({ "header", "decode", "checksum" }));
+
+    // Either side can replace its own input
+    string text = generateText(50000, 23);
+    ofstream("huffman-test.in", ios::binary) << text;
+    compressFile("huffman-test.in", "huffman-test.in");
+    decompressFile("huffman-test.in", "huffman-test.in");
+    ifstream in("huffman-test.in", ios::binary);
+    EXPECT_EQUAL(string((istreambuf_iterator<char>(in)), istreambuf_iterator<char>()), text);
+    EXPECT(!ifstream("huffman-test.in" + FILE_PARTIAL_SUFFIX));
+    remove("huffman-test.in");
+    remove("huffman-test.huf");
+    remove("huffman-test.out");
+}
+
+STUDENT_TEST("decompressFile, reports errors on bad or corrupt files") {
+    EXPECT_EQUAL(crc32(reinterpret_cast<const uint8_t*>("123456789"), 9), 0xCBF43926);
+    ofstream("huffman-test.in", ios::binary) << generateText(20000, 22);
+    compressFile("huffman-test.in", "huffman-test.huf");
+    ifstream in("huffman-test.huf", ios::binary);
+    string compressed((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+    in.close();
+
+    ofstream("huffman-test.bad", ios::binary) << "HUFS" + compressed.substr(4);
+    EXPECT_ERROR(decompressFile("huffman-test.bad", "huffman-test.out"));
+    ofstream("huffman-test.bad", ios::binary) << compressed.substr(0, compressed.size() / 2);
+    EXPECT_ERROR(decompressFile("huffman-test.bad", "huffman-test.out"));
+    string flipped = compressed;
+    flipped[flipped.size() / 2] ^= 0x10;
+    ofstream("huffman-test.bad", ios::binary) << flipped;
+    EXPECT_ERROR(decompressFile("huffman-test.bad", "huffman-test.out"));
+    EXPECT_ERROR(decompressFile("huffman-test.missing", "huffman-test.out"));
+
+    // A failed decompress leaves an existing output alone and no partial file behind
+    ofstream("huffman-test.out", ios::binary) << "keep me";
+    ofstream("huffman-test.bad", ios::binary) << flipped;
+    EXPECT_ERROR(decompressFile("huffman-test.bad", "huffman-test.out"));
+    string forged = compressed;
+    forged[6] = 0x01;  // the high byte of the original length
+    ofstream("huffman-test.bad", ios::binary) << forged;
+    EXPECT_ERROR(decompressFile("huffman-test.bad", "huffman-test.out"));
+
+    // A forged tree shape: a run of parents with no leaves, and a lone leaf that leaves bits over
+    compressFile("huffman-test.in", "huffman-test.huf", FILE_KIND_TREE);
+    ifstream treeIn("huffman-test.huf", ios::binary);
+    string treeFile((istreambuf_iterator<char>(treeIn)), istreambuf_iterator<char>());
+    treeIn.close();
+    const size_t shapeStart = sizeof(FILE_MAGIC) + 1 + 1 + 8 + 4 + 8;
+    string deepShape = treeFile;
+    for (size_t i = shapeStart; i < shapeStart + 8; i++) {
+        deepShape[i] = (char) 0xFF;
+    }
+    ofstream("huffman-test.bad", ios::binary) << deepShape;
+    EXPECT_ERROR(decompressFile("huffman-test.bad", "huffman-test.out"));
+    string leafShape = treeFile;
+    leafShape[shapeStart] = 0;
+    ofstream("huffman-test.bad", ios::binary) << leafShape;
+    EXPECT_ERROR(decompressFile("huffman-test.bad", "huffman-test.out"));
+    ofstream("huffman-test.bad", ios::binary) << treeFile;
+    EXPECT_NO_ERROR(decompressFile("huffman-test.bad", "huffman-test.bad.out"));
+    remove("huffman-test.bad.out");
+
+    ifstream kept("huffman-test.out", ios::binary);
+    string keptText((istreambuf_iterator<char>(kept)), istreambuf_iterator<char>());
+    EXPECT_EQUAL(keptText, "keep me");
+    EXPECT(!ifstream("huffman-test.out" + FILE_PARTIAL_SUFFIX));
+    remove("huffman-test.in");
+    remove("huffman-test.huf");
+    remove("huffman-test.bad");
+    remove("huffman-test.out");
+}
+
+STUDENT_TEST("binary data, NULs and bytes above 0x7F round-trip through every codec") {
+    string binary(3000, '\0');
+    for (int i = 0; i < 3000; i++) {
+        binary[i] = (char) (i % 7 == 0 ? 0 : i % 3 == 0 ? 0xFF : (i * 37) % 256);
+    }
+    Vector<string> inputs = { string("\0\0\x80", 3), string("\xFF\x00\xFF\x7F\x80", 5), binary };
+    for (string input : inputs) {
+        EncodedData data = compress(input);
+        EXPECT_EQUAL(decompress(data), input);
+        PackedEncodedData packed = compressPacked(input);
+        EXPECT_EQUAL(decompress(packed), input);
+        CanonicalEncodedData canonical = compressCanonical(input, 12, 4);
+        EXPECT_EQUAL(decompress(canonical), input);
+        EXPECT_EQUAL(decompressParallel(compressParallel(input, 2, 1000), 2), input);
+
+        EncodingTreeNode* tree = buildHuffmanTree(input);
+        EncodingTreeNode* twoQueueTree = buildHuffmanTreeTwoQueue(input);
+        BitBuffer shape;
+        string leaves;
+        flattenTree(tree, shape, leaves);
+        EXPECT_EQUAL(encodedCost(twoQueueTree, input), encodedCost(tree, input));
+        CompactTree compact;
+        unflattenTree(shape, leaves, compact);
+        BitBuffer messageBits;
+        encodeText(compact, input, messageBits);
+        EXPECT_EQUAL(decodeText(compact, messageBits), input);
+        deallocateTree(tree);
+        deallocateTree(twoQueueTree);
+    }
+    EncodingTreeNode* tree = buildHuffmanTree(string("a\x80\x80", 3));
+    EXPECT_EQUAL(tree->zero->getChar(), 'a');
+    EXPECT_EQUAL(tree->one->getChar(), '\x80');
+    deallocateTree(tree);
+}
+
+STUDENT_TEST("string_view overloads and decompress into a caller buffer match the string versions") {
+    string text = generateText(50000, 23);
+    string_view view(text.data() + 100, 20000);
+    string copy(view);
+    EncodedData fromView = compress(view);
+    EncodedData fromCopy = compress(copy);
+    EXPECT_EQUAL(fromView.treeShape, fromCopy.treeShape);
+    EXPECT_EQUAL(fromView.messageBits, fromCopy.messageBits);
+    EncodingTreeNode* tree = buildHuffmanTree(view);
+    EXPECT_EQUAL(encodeText(tree, view), encodeText(tree, copy));
+    deallocateTree(tree);
+
+    PackedEncodedData packed = compressPacked(view);
+    vector<char> buffer(view.size() + 10, '#');
+    EXPECT_EQUAL(decompress(packed, buffer.data(), buffer.size()), view.size());
+    EXPECT_EQUAL(string_view(buffer.data(), view.size()), view);
+    EXPECT_EQUAL(buffer[view.size()], '#');
+
+    packed = compressPacked(view);
+    EXPECT_EQUAL(decompress(packed, buffer.data(), view.size()), view.size());
+    packed = compressPacked(view);
+    EXPECT_ERROR(decompress(packed, buffer.data(), view.size() - 1));
+}
+
+STUDENT_TEST("symbolCount, recorded by the encoders and checked by decompress") {
+    string text = generateText(30000, 24);
+    PackedEncodedData packed = compressPacked(text);
+    EXPECT_EQUAL(packed.symbolCount, text.size());
+    packed.symbolCount--;
+    EXPECT_ERROR(decompress(packed));
+    packed = compressPacked(text);
+    packed.symbolCount++;
+    EXPECT_ERROR(decompress(packed));
+
+    CanonicalEncodedData canonical = compressCanonical(text);
+    ostringstream out;
+    writeCanonicalData(out, canonical);
+    istringstream in(out.str());
+    CanonicalEncodedData readBack;
+    readCanonicalData(in, readBack);
+    EXPECT_EQUAL(readBack.symbolCount, text.size());
+    EXPECT_EQUAL(decompress(readBack), text);
+}
+
+STUDENT_TEST("trainTable, shared tables round-trip short messages, including unseen bytes") {
+    Vector<string> samples;
+    for (int i = 0; i < 20; i++) {
+        samples.add(generateText(500, 30 + i));
+    }
+    HuffmanTable table = trainTable(samples, 7);
+    Vector<string> messages = { "", "e", generateText(200, 60), string("\0\xFF\x80 unseen {}", 14) };
+    for (string message : messages) {
+        string compressed = compressWithTable(message, table);
+        EXPECT_EQUAL(messageTableId(compressed), 7);
+        EXPECT_EQUAL(decompressWithTable(compressed, table), message);
+    }
+    string record = generateText(200, 61);
+    EXPECT(compressWithTable(record, table).size() < compressPacked(record).treeLeaves.size() + 120);
+
+    ostringstream out;
+    writeTable(out, table);
+    istringstream in(out.str());
+    HuffmanTable readBack = readTable(in);
+    EXPECT_EQUAL(readBack.id, 7);
+    EXPECT_EQUAL(compressWithTable(record, readBack), compressWithTable(record, table));
+
+    // An id past any int's is rejected rather than narrowed to table 7's
+    string forged;
+    appendVarint(forged, ((uint64_t) 1 << 32) + 7);
+    EXPECT_ERROR(messageTableId(forged + compressWithTable(record, table).substr(1)));
+
+    HuffmanTable other = trainTable(samples, 8, 15);
+    EXPECT_ERROR(decompressWithTable(compressWithTable(record, table), other));
+    string truncated = compressWithTable(record, table);
+    EXPECT_ERROR(decompressWithTable(truncated.substr(0, truncated.size() / 2), table));
+    EXPECT_ERROR(trainTable(samples, 1, 7));
+    istringstream bad("HUFS" + out.str().substr(4));
+    EXPECT_ERROR(readTable(bad));
+}
+
+STUDENT_TEST("trainTable, 1000 records of 200 bytes take less room than a tree per record") {
+    Vector<string> samples;
+    for (int i = 0; i < 50; i++) {
+        samples.add(generateText(1000, 100 + i));
+    }
+    HuffmanTable table = trainTable(samples, 1);
+    string text = generateText(1000 * 200, 25);
+    uint64_t tableBytes = 0, treeBytes = 0;
+    for (size_t offset = 0; offset < text.size(); offset += 200) {
+        string_view record = string_view(text).substr(offset, 200);
+        string compressed = compressWithTable(record, table);
+        EXPECT_EQUAL(decompressWithTable(compressed, table), string(record));
+        tableBytes += compressed.size();
+        PackedEncodedData data = compressPacked(record);
+        treeBytes += (data.treeShape.size() + 7) / 8 + data.treeLeaves.size() + (data.messageBits.size() + 7) / 8;
+    }
+    EXPECT(tableBytes < treeBytes);
+}
+
+STUDENT_TEST("compressAdaptive, round-trips in memory and as a stream") {
+    string binary = "";
+    for (int i = 0; i < 20000; i++) {
+        binary += (char) ((i * 7919) % 256);
+    }
+    Vector<string> inputs = { "", "a", "aaaaaaaa", "STREETTEST", binary, generateText(100000, 26) };
+    for (string input : inputs) {
+        string compressed = compressAdaptive(input);
+        EXPECT_EQUAL(decompressAdaptive(compressed), input);
+        istringstream in(input);
+        ostringstream out;
+        compressAdaptiveStream(in, out);
+        EXPECT_EQUAL(out.str(), compressed);
+        istringstream compressedIn(compressed);
+        ostringstream decompressed;
+        decompressAdaptiveStream(compressedIn, decompressed);
+        EXPECT_EQUAL(decompressed.str(), input);
+    }
+    string compressed = compressAdaptive(generateText(1000, 27));
+    EXPECT_ERROR(decompressAdaptive(compressed.substr(0, compressed.size() / 2)));
+}
+
+STUDENT_TEST("compressAdaptive, round-trips a message using all 256 byte values") {
+    // Every byte and the end marker are new symbols, so the tree grows to its full size
+    string everyByte = "";
+    for (int round = 0; round < 3; round++) {
+        for (int symbol = 0; symbol < 256; symbol++) {
+            everyByte += (char) (round % 2 == 0 ? symbol : 255 - symbol);
+        }
+    }
+    string compressed = compressAdaptive(everyByte);
+    EXPECT_EQUAL(decompressAdaptive(compressed), everyByte);
+    istringstream compressedIn(compressed);
+    ostringstream decompressed;
+    decompressAdaptiveStream(compressedIn, decompressed);
+    EXPECT_EQUAL(decompressed.str(), everyByte);
+}
+
+STUDENT_TEST("compressAdaptive, comes within 1% of the two-pass canonical code") {
+    for (int length : { 1000, 100000 }) {
+        string text = generateText(length, 28);
+        string adaptive = compressAdaptive(text);
+        EXPECT_EQUAL(decompressAdaptive(adaptive), text);
+        ostringstream canonical;
+        writeCanonicalData(canonical, compressCanonical(text));
+        EXPECT(adaptive.size() <= canonical.str().size() * 101 / 100);
+    }
+}
+
+STUDENT_TEST("compressOrder1, round-trips and beats order-0 on text with order-1 structure") {
+    // Each letter is mostly followed by one of two letters that depend on it
+    setRandomSeed(31);
+    string markov = "a";
+    for (int i = 1; i < 200000; i++) {
+        char previous = markov[i - 1];
+        int next = randomChance(0.9) ? (previous - 'a') * 7 + randomInteger(0, 1) : randomInteger(0, 25);
+        markov += (char) ('a' + next % 26);
+    }
+    Vector<string> inputs = { "", "a", "STREETTEST", string("\0\xFF\0\xFF\x80", 5), generateText(50000, 32), markov };
+    for (string input : inputs) {
+        for (int tables : { 1, 3, ORDER1_DEFAULT_TABLES }) {
+            Order1EncodedData data = compressOrder1(input, tables);
+            EXPECT(data.tables.size() <= tables);
+            ostringstream out;
+            writeOrder1Data(out, data);
+            EXPECT_EQUAL(decompress(data), input);
+            istringstream in(out.str());
+            Order1EncodedData readBack;
+            readOrder1Data(in, readBack);
+            EXPECT_EQUAL(decompress(readBack), input);
+        }
+    }
+    Order1EncodedData order1 = compressOrder1(markov);
+    Order1EncodedData order1Max = compressOrder1(markov, ORDER1_MAX_TABLES);
+    CanonicalEncodedData order0 = compressCanonical(markov);
+    EXPECT(order1.messageBits.size() < order0.messageBits.size() * 4 / 5);
+    EXPECT(order1Max.messageBits.size() < order1.messageBits.size());
+    EXPECT_ERROR(compressOrder1(markov, 0));
+    EXPECT_ERROR(compressOrder1(markov, ORDER1_MAX_TABLES + 1));
+
+    // A bit count longer than every symbol's longest code is rejected before it is allocated
+    Order1EncodedData small = compressOrder1("STREETTEST");
+    ostringstream smallOut;
+    writeOrder1Data(smallOut, small);
+    string serialized = smallOut.str();
+    size_t bitCountAt = serialized.size() - (small.messageBits.size() + 7) / 8 - 8;
+    for (uint64_t bitCount : { small.symbolCount * ORDER1_CODE_LENGTH + 1, ~(uint64_t) 0 }) {
+        ostringstream forgedCount;
+        writeBigEndian(forgedCount, bitCount, 8);
+        string forged = serialized;
+        forged.replace(bitCountAt, 8, forgedCount.str());
+        istringstream forgedIn(forged);
+        Order1EncodedData readBack;
+        EXPECT_ERROR(readOrder1Data(forgedIn, readBack));
+    }
+
+    // A forged symbol count large enough to vouch for a huge bit count is stopped by maxBits, or
+    // without one by the end of the input, before the bits are allocated
+    uint64_t huge = (uint64_t) 1 << 40;
+    ostringstream forgedCounts;
+    writeBigEndian(forgedCounts, huge, 8);
+    writeBigEndian(forgedCounts, huge, 8);
+    string forged = serialized;
+    forged.replace(bitCountAt - 8, 16, forgedCounts.str());
+    for (uint64_t maxBits : { (uint64_t) 8 * forged.size(), ~(uint64_t) 0 }) {
+        istringstream forgedIn(forged);
+        Order1EncodedData readBack;
+        EXPECT_ERROR(readOrder1Data(forgedIn, readBack, maxBits));
+    }
+
+}
+
+STUDENT_TEST("compressSplit, round-trips and follows drifting statistics") {
+    string binary = "";
+    for (int i = 0; i < 3000; i++) {
+        binary += (char) (i < 1500 ? i % 3 : 128 + i % 50);
+    }
+    Vector<string> inputs = { "", "a", "aaaa", "STREETTEST", binary, generateText(100000, 33) };
+    for (string input : inputs) {
+        for (size_t blockSize : { (size_t) 7, (size_t) 1000, SPLIT_BLOCK_SIZE }) {
+            EXPECT_EQUAL(decompressSplit(compressSplit(input, blockSize)), input);
+            EXPECT_EQUAL(decompressSplit(compressSplit(input, blockSize, 11)), input);
+        }
+    }
+
+    // Alternate English-like text with base64-like runs, 64 KB of each
+    const string base64 = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    string drifting = "";
+    setRandomSeed(34);
+    for (int section = 0; section < 8; section++) {
+        if (section % 2 == 0) {
+            drifting += generateText(1 << 16, 35 + section);
+        } else {
+            for (int i = 0; i < (1 << 16); i++) {
+                drifting += base64[randomInteger(0, 63)];
+            }
+        }
+    }
+    ostringstream single;
+    writeCanonicalData(single, compressCanonical(drifting));
+    string split = compressSplit(drifting);
+    EXPECT_EQUAL(decompressSplit(split), drifting);
+    EXPECT(split.size() < single.str().size() * 19 / 20);
+
+    // Steady text mostly reuses tables, so it costs little more than a single table
+    string steady = generateText(1 << 19, 36);
+    ostringstream steadySingle;
+    writeCanonicalData(steadySingle, compressCanonical(steady));
+    string steadySplit = compressSplit(steady);
+    EXPECT(steadySplit.size() < steadySingle.str().size() * 201 / 200);
+
+    EXPECT_ERROR(decompressSplit("HUFS"));
+    EXPECT_ERROR(decompressSplit(split.substr(0, split.size() / 2)));
+}
+
+STUDENT_TEST("compressSplit, rejects a block size that is 0 or too large for its length field") {
+    EXPECT_ERROR(compressSplit("HAPPY HIP HOP", 0));
+    EXPECT_ERROR(compressSplit("HAPPY HIP HOP", (size_t) 1 << 32));
+    EXPECT_EQUAL(decompressSplit(compressSplit("HAPPY HIP HOP", 0xFFFFFFFF)), "HAPPY HIP HOP");
+}
+
+STUDENT_TEST("compressSplit, a fresh table costs exactly the header bits it is charged") {
+    string text = "STREETTEST";
+    uint64_t counts[256] = { 0 };
+    countFrequencies(reinterpret_cast<const uint8_t*>(text.data()), text.size(), counts);
+    int lengths[256] = { 0 };
+    canonicalCodeLengths(counts, 0, lengths);
+    // Magic, version and total length, then one block's length, flag, table and bit count
+    uint64_t expected = 4 + 1 + 8 + 4 + 1 + headerBits(lengths) / 8 + 8 + (codedBits(counts, lengths) + 7) / 8;
+    EXPECT_EQUAL(compressSplit(text).size(), expected);
+}
+
+STUDENT_TEST("timePhases, the huff bench phases decode back to the input") {
+    string text = generateText(200000, 43);
+    uint64_t compressedSize = 0;
+    Vector<PhaseTime> phases = timePhases(text, compressedSize);
+    EXPECT(compressedSize > 0 && compressedSize < text.size());
+    // The phases time the canonical code that huff c writes
+    CanonicalEncodedData data = compressCanonical(text);
+    ostringstream header;
+    writeCanonicalHeader(header, data);
+    EXPECT_EQUAL(compressedSize, header.str().size() + 8 + (data.messageBits.size() + 7) / 8);
+    Vector<string> names;
+    for (const PhaseTime& phase : phases) {
+        names.add(phase.phase);
+        EXPECT(phase.seconds >= 0);
+    }
+    EXPECT_EQUAL(names, Vector<string>({ "histogram", "code build", "encode", "decode" }));
+}
+
+STUDENT_TEST("timePhases, reports empty input and builds trees from one histogram") {
+    uint64_t compressedSize = 0;
+    EXPECT_ERROR(timePhases("", compressedSize));
+    for (string text : { "a", "aaaa", "ab" }) {
+        compressedSize = 0;
+        timePhases(text, compressedSize);
+        EXPECT(compressedSize > 0);
+    }
+
+    // The tree built from counts is the tree buildHuffmanTree builds from the text
+    string text = generateText(50000, 44);
+    uint64_t counts[256] = { 0 };
+    countFrequencies(reinterpret_cast<const uint8_t*>(text.data()), text.size(), counts);
+    TreeArena fromCountsArena, fromTextArena;
+    BitBuffer fromCountsShape, fromTextShape;
+    string fromCountsLeaves = "", fromTextLeaves = "";
+    flattenTree(buildHuffmanTreeFromCounts(counts, &fromCountsArena), fromCountsShape, fromCountsLeaves);
+    flattenTree(buildHuffmanTree(text, fromTextArena), fromTextShape, fromTextLeaves);
+    EXPECT_EQUAL(unpackBits(fromCountsShape), unpackBits(fromTextShape));
+    EXPECT_EQUAL(fromCountsLeaves, fromTextLeaves);
+}
+
 /* * * * * Provided Tests Below This Point * * * * */
 
 PROVIDED_TEST("decodeText, small example encoding tree") {